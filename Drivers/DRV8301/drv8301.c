@@ -49,6 +49,7 @@
 // **************************************************************************
 // the defines
 
+#define DRV8301_SPI_TIMEOUT 10 // [ms] a transfer takes a few us, this only catches a stuck bus
 
 // **************************************************************************
 // the globals
@@ -57,6 +58,29 @@
 // **************************************************************************
 // the function prototypes
 
+static void DRV8301_parseStatus1(DRV_SPI_8301_Vars_t *Spi_8301_Vars, uint16_t drvDataNew)
+{
+  Spi_8301_Vars->Stat_Reg_1.FAULT = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FAULT_BITS);
+  Spi_8301_Vars->Stat_Reg_1.GVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_GVDD_UV_BITS);
+  Spi_8301_Vars->Stat_Reg_1.PVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_PVDD_UV_BITS);
+  Spi_8301_Vars->Stat_Reg_1.OTSD = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTSD_BITS);
+  Spi_8301_Vars->Stat_Reg_1.OTW = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTW_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETHA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHA_OC_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETLA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLA_OC_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETHB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHB_OC_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETLB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLB_OC_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETHC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHC_OC_BITS);
+  Spi_8301_Vars->Stat_Reg_1.FETLC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLC_OC_BITS);
+}
+
+
+static void DRV8301_parseStatus2(DRV_SPI_8301_Vars_t *Spi_8301_Vars, uint16_t drvDataNew)
+{
+  Spi_8301_Vars->Stat_Reg_2.GVDD_OV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS2_GVDD_OV_BITS);
+  Spi_8301_Vars->Stat_Reg_2.DeviceID = (uint16_t)(drvDataNew & (uint16_t)DRV8301_STATUS2_ID_BITS);
+}
+
+
 void DRV8301_enable(DRV8301_Handle handle)
 {
 
@@ -359,32 +383,23 @@ bool DRV8301_isReset(DRV8301_Handle handle)
 
 uint16_t DRV8301_readSpi(DRV8301_Handle handle, const DRV8301_RegName_e regName)
 {
-
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_RESET);
-  osDelay(1);
-
-  // Do blocking read
+  // The response to the read command comes out in the next frame.
+  // Datasheet says you don't have to pulse the nCS between transfers, (16 clocks should commit the transfer)
+  // but for some reason you actually need to pulse it, so these are two queued transfers.
   uint16_t zerobuff = 0;
   uint16_t controlword = (uint16_t)DRV8301_buildCtrlWord(DRV8301_CtrlMode_Read, regName, 0);
+  uint16_t dummybuff;
   uint16_t recbuff = 0xbeef;
-  HAL_SPI_Transmit(handle->spiHandle, (uint8_t*)(&controlword), 1, 1000);
-
-  // Datasheet says you don't have to pulse the nCS between transfers, (16 clocks should commit the transfer)
-  // but for some reason you actually need to pulse it.
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_SET);
-  osDelay(1);
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_RESET);
-  osDelay(1);
-
-  HAL_SPI_TransmitReceive(handle->spiHandle, (uint8_t*)(&zerobuff), (uint8_t*)(&recbuff), 1, 1000);
-  osDelay(1);
+  SPI3_Transfer_t transfers[2] = {
+    {.nCS_port = handle->nCSgpioHandle, .nCS_pin = handle->nCSgpioNumber, .tx_buf = &controlword, .rx_buf = &dummybuff, .length = 1},
+    {.nCS_port = handle->nCSgpioHandle, .nCS_pin = handle->nCSgpioNumber, .tx_buf = &zerobuff, .rx_buf = &recbuff, .length = 1}
+  };
+  SPI3_Queue_Transfer(&transfers[0]);
+  SPI3_Queue_Transfer(&transfers[1]);
 
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_SET);
-  osDelay(1);
+  // Transfers complete in order, so the last one covers both
+  if (!SPI3_Wait_Transfer(&transfers[1], DRV8301_SPI_TIMEOUT))
+    handle->RxTimeOut = true;
 
   assert(recbuff != 0xbeef);
 
@@ -588,18 +603,14 @@ void DRV8301_setShuntAmpGain(DRV8301_Handle handle,const DRV8301_ShuntAmpGain_e
 
 void DRV8301_writeSpi(DRV8301_Handle handle, const DRV8301_RegName_e regName,const uint16_t data)
 {
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_RESET);
-  osDelay(1);
-
-  // Do blocking write
   uint16_t controlword = (uint16_t)DRV8301_buildCtrlWord(DRV8301_CtrlMode_Write, regName, data);
-  HAL_SPI_Transmit(handle->spiHandle, (uint8_t*)(&controlword), 1, 1000);
-  osDelay(1);
-
-  // Actuate chipselect
-  HAL_GPIO_WritePin(handle->nCSgpioHandle, handle->nCSgpioNumber, GPIO_PIN_SET);
-  osDelay(1);
+  uint16_t dummybuff;
+  SPI3_Transfer_t transfer = {
+    .nCS_port = handle->nCSgpioHandle, .nCS_pin = handle->nCSgpioNumber, .tx_buf = &controlword, .rx_buf = &dummybuff, .length = 1
+  };
+  SPI3_Queue_Transfer(&transfer);
+  if (!SPI3_Wait_Transfer(&transfer, DRV8301_SPI_TIMEOUT))
+    handle->RxTimeOut = true;
 
   return;
 }  // end of DRV8301_writeSpi() function
@@ -648,23 +659,12 @@ void DRV8301_readData(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars)
     // Update Status Register 1
     drvRegName = DRV8301_RegName_Status_1;
     drvDataNew = DRV8301_readSpi(handle,drvRegName);
-    Spi_8301_Vars->Stat_Reg_1.FAULT = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FAULT_BITS);
-    Spi_8301_Vars->Stat_Reg_1.GVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_GVDD_UV_BITS);
-    Spi_8301_Vars->Stat_Reg_1.PVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_PVDD_UV_BITS);
-    Spi_8301_Vars->Stat_Reg_1.OTSD = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTSD_BITS);
-    Spi_8301_Vars->Stat_Reg_1.OTW = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTW_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETHA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHA_OC_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETLA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLA_OC_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETHB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHB_OC_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETLB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLB_OC_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETHC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHC_OC_BITS);
-    Spi_8301_Vars->Stat_Reg_1.FETLC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLC_OC_BITS);
+    DRV8301_parseStatus1(Spi_8301_Vars, drvDataNew);
 
     // Update Status Register 2
     drvRegName = DRV8301_RegName_Status_2;
     drvDataNew = DRV8301_readSpi(handle,drvRegName);
-    Spi_8301_Vars->Stat_Reg_2.GVDD_OV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS2_GVDD_OV_BITS);
-    Spi_8301_Vars->Stat_Reg_2.DeviceID = (uint16_t)(drvDataNew & (uint16_t)DRV8301_STATUS2_ID_BITS);
+    DRV8301_parseStatus2(Spi_8301_Vars, drvDataNew);
 
     // Update Control Register 1
     drvRegName = DRV8301_RegName_Control_1;
@@ -731,23 +731,12 @@ void DRV8301_setupSpi(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars)
   // Update Status Register 1
   drvRegName = DRV8301_RegName_Status_1;
   drvDataNew = DRV8301_readSpi(handle,drvRegName);
-  Spi_8301_Vars->Stat_Reg_1.FAULT = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FAULT_BITS);
-  Spi_8301_Vars->Stat_Reg_1.GVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_GVDD_UV_BITS);
-  Spi_8301_Vars->Stat_Reg_1.PVDD_UV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_PVDD_UV_BITS);
-  Spi_8301_Vars->Stat_Reg_1.OTSD = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTSD_BITS);
-  Spi_8301_Vars->Stat_Reg_1.OTW = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_OTW_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETHA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHA_OC_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETLA_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLA_OC_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETHB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHB_OC_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETLB_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLB_OC_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETHC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETHC_OC_BITS);
-  Spi_8301_Vars->Stat_Reg_1.FETLC_OC = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS1_FETLC_OC_BITS);
+  DRV8301_parseStatus1(Spi_8301_Vars, drvDataNew);
 
   // Update Status Register 2
   drvRegName = DRV8301_RegName_Status_2;
   drvDataNew = DRV8301_readSpi(handle,drvRegName);
-  Spi_8301_Vars->Stat_Reg_2.GVDD_OV = (bool)(drvDataNew & (uint16_t)DRV8301_STATUS2_GVDD_OV_BITS);
-  Spi_8301_Vars->Stat_Reg_2.DeviceID = (uint16_t)(drvDataNew & (uint16_t)DRV8301_STATUS2_ID_BITS);
+  DRV8301_parseStatus2(Spi_8301_Vars, drvDataNew);
 
   // Update Control Register 1
   drvRegName = DRV8301_RegName_Control_1;
@@ -770,4 +759,45 @@ void DRV8301_setupSpi(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars)
 }
 
 
+static void DRV8301_statusReadComplete(SPI3_Transfer_t *transfer)
+{
+  DRV8301_Handle handle = (DRV8301_Handle)transfer->ctx;
+
+  // Every frame returns the register requested in the previous one
+  if(transfer->success)
+  {
+    DRV8301_parseStatus1(handle->statusVars, handle->statusRxBuf[1] & DRV8301_DATA_MASK);
+    DRV8301_parseStatus2(handle->statusVars, handle->statusRxBuf[2] & DRV8301_DATA_MASK);
+  }
+  handle->statusBusy = false;
+}
+
+
+bool DRV8301_readStatusAsync(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars)
+{
+  if(handle->statusBusy)
+    return false;
+  handle->statusBusy = true;
+  handle->statusVars = Spi_8301_Vars;
+
+  handle->statusTxBuf[0] = (uint16_t)DRV8301_buildCtrlWord(DRV8301_CtrlMode_Read, DRV8301_RegName_Status_1, 0);
+  handle->statusTxBuf[1] = (uint16_t)DRV8301_buildCtrlWord(DRV8301_CtrlMode_Read, DRV8301_RegName_Status_2, 0);
+  handle->statusTxBuf[2] = 0;
+  for(int i = 0; i < 3; ++i)
+  {
+    SPI3_Transfer_t *transfer = &handle->statusTransfers[i];
+    transfer->nCS_port = handle->nCSgpioHandle;
+    transfer->nCS_pin = handle->nCSgpioNumber;
+    transfer->tx_buf = &handle->statusTxBuf[i];
+    transfer->rx_buf = &handle->statusRxBuf[i];
+    transfer->length = 1;
+    transfer->on_complete = (i == 2) ? &DRV8301_statusReadComplete : NULL;
+    transfer->ctx = handle;
+    SPI3_Queue_Transfer(transfer);
+  }
+
+  return true;
+}  // end of DRV8301_readStatusAsync() function
+
+
 // end of file
@@ -48,6 +48,7 @@
 // drivers
 
 #include "stm32f4xx_hal.h"
+#include "spi.h"
 
 // Port
 typedef SPI_HandleTypeDef* SPI_Handle;
@@ -428,6 +429,11 @@ typedef struct _DRV8301_Obj_
   GPIO_Number_e    nCSgpioNumber;               //!< the gpio number that is connected to the drv8301 nCS pin
   bool             RxTimeOut;                  //!< the timeout flag for the RX fifo
   bool             enableTimeOut;              //!< the timeout flag for drv8301 enable
+  SPI3_Transfer_t  statusTransfers[3];         //!< the pipelined status register read, see DRV8301_readStatusAsync
+  uint16_t         statusTxBuf[3];
+  uint16_t         statusRxBuf[3];
+  DRV_SPI_8301_Vars_t *statusVars;             //!< where the status read is stored
+  volatile bool    statusBusy;                 //!< a status read is in progress
 } DRV8301_Obj;
 
 
@@ -708,6 +714,14 @@ extern void DRV8301_readData(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_830
 extern void DRV8301_setupSpi(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars);
 
 
+//! \brief     Starts reading both status registers into Spi_8301_Vars, without waiting for the result.
+//!            Stat_Reg_1 and Stat_Reg_2 are updated from the SPI DMA interrupt, statusBusy is cleared after that.
+//! \param[in] handle  The DRV8301 handle
+//! \param[in] Spi_8301_Vars  The (DRV_SPI_8301_Vars_t) structure that receives the status registers
+//! \return    false if the previous status read is still in progress
+extern bool DRV8301_readStatusAsync(DRV8301_Handle handle, DRV_SPI_8301_Vars_t *Spi_8301_Vars);
+
+
 #ifdef __cplusplus
 }
 #endif // extern "C"
@@ -9,5 +9,7 @@ osSemaphoreId sem_usb_irq;
 osThreadId thread_motor_0;
 osThreadId thread_motor_1;
 osThreadId thread_usb_cmd;
+osThreadId thread_can;
+osThreadId thread_subscriptions;
 
 #endif /* __FREERTOS_H */
\ No newline at end of file
@@ -135,10 +135,12 @@
 #define M0_CH_GPIO_Port GPIOA
 #define M0_ENC_Z_Pin GPIO_PIN_15
 #define M0_ENC_Z_GPIO_Port GPIOA
+#define M0_ENC_Z_EXTI_IRQn EXTI15_10_IRQn
 #define nFAULT_Pin GPIO_PIN_2
 #define nFAULT_GPIO_Port GPIOD
 #define M1_ENC_Z_Pin GPIO_PIN_3
 #define M1_ENC_Z_GPIO_Port GPIOB
+#define M1_ENC_Z_EXTI_IRQn EXTI3_IRQn
 #define M0_ENC_A_Pin GPIO_PIN_4
 #define M0_ENC_A_GPIO_Port GPIOB
 #define M0_ENC_B_Pin GPIO_PIN_5
@@ -150,9 +152,6 @@
 
 /* USER CODE BEGIN Private defines */
 
-#define CURRENT_MEAS_PERIOD ((float)(2*TIM_1_8_PERIOD_CLOCKS)/(float)TIM_1_8_CLOCK_HZ)
-#define CURRENT_MEAS_HZ (TIM_1_8_CLOCK_HZ/(2*TIM_1_8_PERIOD_CLOCKS))
-
 #define MACRO_MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MACRO_MIN(x, y) (((x) < (y)) ? (x) : (y))
 
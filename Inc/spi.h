@@ -58,13 +58,28 @@
 #include "main.h"
 
 /* USER CODE BEGIN Includes */
-
+#include <stdbool.h>
 /* USER CODE END Includes */
 
 extern SPI_HandleTypeDef hspi3;
 
 /* USER CODE BEGIN Private defines */
 
+// One SPI3 DMA transfer with a software chip select, see SPI3_Queue_Transfer.
+// The transfer and its buffers must stay valid until it is done.
+typedef struct SPI3_Transfer_s {
+  GPIO_TypeDef* nCS_port;
+  uint16_t nCS_pin;
+  const uint16_t* tx_buf;
+  uint16_t* rx_buf;
+  uint16_t length; // [16bit frames]
+  void (*on_complete)(struct SPI3_Transfer_s* transfer); // called from the DMA interrupt, may be NULL
+  void* ctx; // for on_complete
+  volatile bool done;
+  volatile bool success;
+  struct SPI3_Transfer_s* next; // owned by the queue
+} SPI3_Transfer_t;
+
 /* USER CODE END Private defines */
 
 extern void _Error_Handler(char *, int);
@@ -73,6 +88,11 @@ void MX_SPI3_Init(void);
 
 /* USER CODE BEGIN Prototypes */
 
+// Appends a transfer to the SPI3 queue and returns immediately. Callable from interrupts.
+void SPI3_Queue_Transfer(SPI3_Transfer_t* transfer);
+// Busy waits until a queued transfer is done, returns false on error or after timeout [ms]
+bool SPI3_Wait_Transfer(SPI3_Transfer_t* transfer, uint32_t timeout);
+
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
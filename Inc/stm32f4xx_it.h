@@ -53,8 +53,15 @@ void UsageFault_Handler(void);
 void DebugMon_Handler(void);
 void SysTick_Handler(void);
 void EXTI2_IRQHandler(void);
+void EXTI3_IRQHandler(void);
 void EXTI4_IRQHandler(void);
+void DMA1_Stream0_IRQHandler(void);
+void DMA1_Stream5_IRQHandler(void);
 void ADC_IRQHandler(void);
+void CAN1_TX_IRQHandler(void);
+void CAN1_RX0_IRQHandler(void);
+void CAN1_RX1_IRQHandler(void);
+void EXTI15_10_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 
 #ifdef __cplusplus
@@ -69,6 +69,12 @@ extern TIM_HandleTypeDef htim8;
 
 /* USER CODE BEGIN Private defines */
 
+// Encoder edge timestamp timers, see Encoder_Edge_Timer_Init
+extern TIM_HandleTypeDef htim5;
+extern TIM_HandleTypeDef htim12;
+// Hardware step counter, see Step_Counter_Timer_Init
+extern TIM_HandleTypeDef htim9;
+
 /* USER CODE END Private defines */
 
 extern void _Error_Handler(char *, int);
@@ -85,6 +91,8 @@ void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 /* USER CODE BEGIN Prototypes */
 
 void OC4_PWM_Override(TIM_HandleTypeDef* htim);
+void Encoder_Edge_Timer_Init(TIM_HandleTypeDef* htim, TIM_TypeDef* instance, uint32_t input_trigger);
+void Step_Counter_Timer_Init(void);
 
 /* USER CODE END Prototypes */
 
@@ -0,0 +1,377 @@
+
+#include <can_protocol.h>
+
+#include <string.h>
+#include <cmsis_os.h>
+#include <can.h>
+#include <low_level.h>
+#include <commands.h>
+
+// Frames waiting for a free transmit mailbox
+#define CAN_TX_QUEUE_SIZE 16
+
+typedef struct {
+    uint16_t id;
+    uint8_t len;
+    uint8_t data[8];
+} Can_frame_t;
+
+// Transmission state of a PDO, owned by can_thread
+typedef struct {
+    uint32_t next_time; // [ms] osKernelSysTick of the next check
+    bool sent; // last_data holds the last payload sent
+    uint8_t last_data[8];
+} Can_pdo_state_t;
+
+// Last setpoint frame of a motor, waiting for the SYNC
+typedef struct {
+    bool pending;
+    Can_msg_t msg;
+    float values[2];
+} Can_setpoint_t;
+
+int can_node_id = 1;
+int can_telemetry_period = 10; // [ms]
+bool can_sync = false;
+int can_tx_dropped = 0;
+Can_pdo_t can_pdos[CAN_NUM_PDOS];
+float can_bus_load = 0.0f;
+
+// can_node_id at startup, the filter is set up for this one
+static int node_id = 1;
+
+static Can_setpoint_t sync_setpoints[2]; // one per entry in motors[]
+
+static Can_pdo_state_t pdo_states[CAN_NUM_PDOS];
+// Set by can_set_pdo, the PDO starts over with the new mapping
+static volatile bool pdo_changed[CAN_NUM_PDOS];
+
+static Can_frame_t tx_queue[CAN_TX_QUEUE_SIZE];
+static int tx_queue_head = 0; // next frame to send
+static int tx_queue_count = 0;
+
+static uint16_t frame_id(int motor_number, Can_msg_t msg) {
+    return (node_id << CAN_NODE_ID_SHIFT) | (motor_number << CAN_MOTOR_SHIFT) | msg;
+}
+
+static float read_float(const uint8_t* data) {
+    float value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Returns false if all three transmit mailboxes are busy
+static bool write_mailbox(const Can_frame_t* frame) {
+    CAN_TypeDef* can = hcan1.Instance;
+    uint32_t tsr = can->TSR;
+    if (!(tsr & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)))
+        return false;
+
+    // CODE holds the number of an empty mailbox when there is one
+    CAN_TxMailBox_TypeDef* mailbox = &can->sTxMailBox[(tsr & CAN_TSR_CODE) >> 24];
+    uint32_t data[2];
+    memcpy(data, frame->data, sizeof(data));
+    mailbox->TDTR = frame->len;
+    mailbox->TDLR = data[0];
+    mailbox->TDHR = data[1];
+    mailbox->TIR = ((uint32_t)frame->id << 21) | CAN_TI0R_TXRQ;
+    return true;
+}
+
+// Callable from any context. Frames go out in order, unless all mailboxes are free
+// again: then the controller sends the lowest identifier first.
+static void can_send(uint16_t id, const void* data, uint8_t len) {
+    Can_frame_t frame = {.id = id, .len = len};
+    memcpy(frame.data, data, len);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (tx_queue_count == 0 && write_mailbox(&frame)) {
+        // sent right away
+    } else if (tx_queue_count < CAN_TX_QUEUE_SIZE) {
+        tx_queue[(tx_queue_head + tx_queue_count) % CAN_TX_QUEUE_SIZE] = frame;
+        ++tx_queue_count;
+    } else {
+        ++can_tx_dropped;
+    }
+    __set_PRIMASK(primask);
+}
+
+void can_tx_cb() {
+    CAN_TypeDef* can = hcan1.Instance;
+    // Acknowledge the completed requests, this clears the interrupt
+    can->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+    while (tx_queue_count > 0 && write_mailbox(&tx_queue[tx_queue_head])) {
+        tx_queue_head = (tx_queue_head + 1) % CAN_TX_QUEUE_SIZE;
+        --tx_queue_count;
+    }
+}
+
+static void apply_setpoint(Motor_t* motor, Can_msg_t msg, const float values[2]) {
+    switch (msg) {
+    case CAN_MSG_SET_POS:
+        set_pos_setpoint(motor, values[0], values[1], 0.0f);
+        break;
+    case CAN_MSG_SET_VEL:
+        set_vel_setpoint(motor, values[0], values[1]);
+        break;
+    case CAN_MSG_SET_CURRENT:
+        set_current_setpoint(motor, values[0]);
+        break;
+    default:
+        break;
+    }
+}
+
+static void handle_frame(const Can_frame_t* frame) {
+    int motor_number = (frame->id >> CAN_MOTOR_SHIFT) & 1;
+    Can_msg_t msg = frame->id & CAN_MSG_MASK;
+    int min_len;
+    switch (msg) {
+    case CAN_MSG_SET_POS:
+    case CAN_MSG_SET_VEL:
+        min_len = 8;
+        break;
+    case CAN_MSG_SET_CURRENT:
+        min_len = 4;
+        break;
+    default:
+        return;
+    }
+    if (frame->len < min_len)
+        return;
+
+    float values[2] = {read_float(&frame->data[0]), read_float(&frame->data[4])};
+    if (can_sync) {
+        // A newer setpoint before the SYNC replaces the older one.
+        // The SYNC interrupt has a higher priority, it must not see half of it.
+        Can_setpoint_t* setpoint = &sync_setpoints[motor_number];
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        setpoint->msg = msg;
+        setpoint->values[0] = values[0];
+        setpoint->values[1] = values[1];
+        setpoint->pending = true;
+        __set_PRIMASK(primask);
+    } else {
+        apply_setpoint(&motors[motor_number], msg, values);
+    }
+}
+
+void can_rx_fifo0_cb() {
+    CAN_TypeDef* can = hcan1.Instance;
+    while (can->RF0R & CAN_RF0R_FMP0) {
+        CAN_FIFOMailBox_TypeDef* mailbox = &can->sFIFOMailBox[0];
+        Can_frame_t frame;
+        uint32_t data[2] = {mailbox->RDLR, mailbox->RDHR};
+        frame.id = mailbox->RIR >> 21; // the filter only passes standard identifiers
+        frame.len = mailbox->RDTR & CAN_RDT0R_DLC;
+        if (frame.len > 8) frame.len = 8;
+        memcpy(frame.data, data, sizeof(data));
+        // Release the FIFO output, the next frame moves up
+        can->RF0R = CAN_RF0R_RFOM0;
+        handle_frame(&frame);
+    }
+}
+
+// Only SYNC frames are filtered into FIFO 1
+void can_rx_fifo1_cb() {
+    CAN_TypeDef* can = hcan1.Instance;
+    if (!(can->RF1R & CAN_RF1R_FMP1))
+        return;
+    if (can_sync) {
+        // Timing first, then the setpoints for the next control cycle
+        pwm_sync_cb();
+        for (int i = 0; i < num_motors; ++i) {
+            Can_setpoint_t* setpoint = &sync_setpoints[i];
+            if (setpoint->pending) {
+                apply_setpoint(&motors[i], setpoint->msg, setpoint->values);
+                setpoint->pending = false;
+            }
+        }
+    }
+    // A SYNC that waited behind another one is late, only the newest counts
+    while (can->RF1R & CAN_RF1R_FMP1)
+        can->RF1R = CAN_RF1R_RFOM1;
+}
+
+static void can_start() {
+    node_id = can_node_id;
+    if (node_id < CAN_NODE_ID_MIN || node_id > CAN_NODE_ID_MAX)
+        node_id = CAN_NODE_ID_MIN;
+
+    // 32 bit mask filter: the node ID bits of the standard identifier must match,
+    // and only standard data frames (IDE = 0, RTR = 0) are accepted.
+    CAN_FilterConfTypeDef filter = {
+        .FilterIdHigh = (node_id << CAN_NODE_ID_SHIFT) << 5,
+        .FilterIdLow = 0,
+        .FilterMaskIdHigh = (CAN_NODE_ID_MAX << CAN_NODE_ID_SHIFT) << 5,
+        .FilterMaskIdLow = CAN_ID_EXT | CAN_RTR_REMOTE,
+        .FilterFIFOAssignment = CAN_FILTER_FIFO0,
+        .FilterNumber = 0,
+        .FilterMode = CAN_FILTERMODE_IDMASK,
+        .FilterScale = CAN_FILTERSCALE_32BIT,
+        .FilterActivation = ENABLE,
+        .BankNumber = 14,
+    };
+    HAL_CAN_ConfigFilter(&hcan1, &filter);
+
+    // SYNC frames go to their own FIFO and interrupt, so they never wait behind setpoints
+    CAN_FilterConfTypeDef sync_filter = {
+        .FilterIdHigh = CAN_SYNC_ID << 5,
+        .FilterIdLow = 0,
+        .FilterMaskIdHigh = 0x7FF << 5,
+        .FilterMaskIdLow = CAN_ID_EXT | CAN_RTR_REMOTE,
+        .FilterFIFOAssignment = CAN_FILTER_FIFO1,
+        .FilterNumber = 1,
+        .FilterMode = CAN_FILTERMODE_IDMASK,
+        .FilterScale = CAN_FILTERSCALE_32BIT,
+        .FilterActivation = ENABLE,
+        .BankNumber = 14,
+    };
+    HAL_CAN_ConfigFilter(&hcan1, &sync_filter);
+    __HAL_CAN_ENABLE_IT(&hcan1, CAN_IT_FMP0 | CAN_IT_FMP1 | CAN_IT_TME);
+}
+
+static void send_telemetry(int motor_number) {
+    Motor_t* motor = &motors[motor_number];
+
+    uint8_t status[8];
+    int32_t error = motor->error;
+    uint16_t gate_driver_fault = motor->gate_driver_fault;
+    memcpy(&status[0], &error, 4);
+    status[4] = motor->control_mode;
+    status[5] = (motor->enable_control ? 1 : 0)
+              | (motor->calibration_ok ? 2 : 0)
+              | (motor->thread_ready ? 4 : 0);
+    memcpy(&status[6], &gate_driver_fault, 2);
+    can_send(frame_id(motor_number, CAN_MSG_STATUS), status, sizeof(status));
+
+    float pos_vel[2] = {motor->rotor.pll_pos, motor->rotor.pll_vel};
+    can_send(frame_id(motor_number, CAN_MSG_POS_VEL), pos_vel, sizeof(pos_vel));
+
+    // Iq_measured is in the rotor frame, the current setpoints are relative to motor_dir
+    float current[2] = {motor->current_control.Iq_measured * motor->rotor.motor_dir,
+                        motor->current_control.Ibus};
+    can_send(frame_id(motor_number, CAN_MSG_CURRENT), current, sizeof(current));
+}
+
+// Returns the payload length
+static int pack_pdo(const Can_pdo_t* pdo, uint8_t data[8]) {
+    int len = 0;
+    for (int i = 0; i < pdo->num_entries; ++i)
+        len += var_read(pdo->entries[i], &data[len]);
+    return len;
+}
+
+bool can_set_pdo(int pdo, int period, bool on_change, const uint16_t* entries, int num_entries) {
+    if (pdo < 0 || pdo >= CAN_NUM_PDOS || period < 0)
+        return false;
+    if (num_entries < 0 || num_entries > CAN_PDO_MAX_ENTRIES)
+        return false;
+    int len = 0;
+    for (int i = 0; i < num_entries; ++i) {
+        int size = var_size(entries[i]);
+        if (size == 0)
+            return false;
+        len += size;
+    }
+    if (len > 8)
+        return false;
+
+    // can_thread copies the mapping under the same lock
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    can_pdos[pdo].period = period;
+    can_pdos[pdo].on_change = on_change;
+    can_pdos[pdo].num_entries = num_entries;
+    memcpy(can_pdos[pdo].entries, entries, num_entries * sizeof(uint16_t));
+    pdo_changed[pdo] = true;
+    __set_PRIMASK(primask);
+    return true;
+}
+
+// Longest standard data frame with len bytes, including the interframe space.
+// Stuff bits are inserted after every 4 bits (worst case) of the 34 + 8 * len bits
+// from the start of frame to the end of the CRC.
+static int frame_bits(int len) {
+    return 47 + 8 * len + (34 + 8 * len - 1) / 4;
+}
+
+float can_bus_load_estimate() {
+    float bits_per_s = 0.0f;
+    int telemetry_period = can_telemetry_period;
+    if (telemetry_period > 0)
+        bits_per_s += num_motors * 3 * frame_bits(8) * 1000.0f / telemetry_period;
+    for (int i = 0; i < CAN_NUM_PDOS; ++i) {
+        Can_pdo_t pdo = can_pdos[i];
+        if (pdo.period <= 0 || pdo.num_entries <= 0)
+            continue;
+        int len = 0;
+        for (int j = 0; j < pdo.num_entries; ++j)
+            len += var_size(pdo.entries[j]);
+        bits_per_s += frame_bits(len) * 1000.0f / pdo.period;
+    }
+    return 100.0f * bits_per_s / 1000000.0f;
+}
+
+// Whether the time of a periodic event has come, and moves it on by period
+static bool period_elapsed(uint32_t* next_time, uint32_t now, int period) {
+    if ((int32_t)(now - *next_time) < 0)
+        return false;
+    *next_time += period;
+    // Don't catch up on missed periods
+    if ((int32_t)(now - *next_time) >= 0)
+        *next_time = now + period;
+    return true;
+}
+
+static void send_pdo(int pdo_number, uint32_t now) {
+    Can_pdo_state_t* state = &pdo_states[pdo_number];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    Can_pdo_t pdo = can_pdos[pdo_number];
+    bool changed = pdo_changed[pdo_number];
+    pdo_changed[pdo_number] = false;
+    __set_PRIMASK(primask);
+
+    bool enabled = pdo.period > 0 && pdo.num_entries > 0;
+    if (changed || !enabled) {
+        state->next_time = now;
+        state->sent = false;
+    }
+    if (!enabled || !period_elapsed(&state->next_time, now, pdo.period))
+        return;
+
+    uint8_t data[8] = {0};
+    int len = pack_pdo(&pdo, data);
+    if (pdo.on_change && state->sent && memcmp(data, state->last_data, len) == 0)
+        return;
+    memcpy(state->last_data, data, len);
+    state->sent = true;
+    can_send(frame_id(0, CAN_MSG_PDO + pdo_number), data, len);
+}
+
+void can_thread(void const * argument) {
+    can_start();
+
+    uint32_t last_wake = osKernelSysTick();
+    uint32_t next_telemetry = last_wake;
+    for (;;) {
+        uint32_t now = osKernelSysTick();
+        int telemetry_period = can_telemetry_period;
+        if (telemetry_period <= 0) {
+            next_telemetry = now;
+        } else if (period_elapsed(&next_telemetry, now, telemetry_period)) {
+            for (int i = 0; i < num_motors; ++i)
+                send_telemetry(i);
+        }
+        for (int i = 0; i < CAN_NUM_PDOS; ++i)
+            send_pdo(i, now);
+        can_bus_load = can_bus_load_estimate();
+        osDelayUntil(&last_wake, 1);
+    }
+
+    // If we get here, then this task is done
+    vTaskDelete(osThreadGetId());
+}
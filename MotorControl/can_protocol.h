@@ -0,0 +1,84 @@
+
+#ifndef __CAN_PROTOCOL_H
+#define __CAN_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Command and telemetry protocol on CAN1, 1 Mbit/s, standard 11 bit identifiers.
+// Each board on the bus owns the 32 identifiers of its node ID:
+//   ID = can_node_id << 5 | motor << 4 | msg
+// The hardware filter only passes frames for this node and SYNC frames.
+// All payloads are little endian, floats are IEEE 754 single precision.
+
+#define CAN_NODE_ID_SHIFT 5
+#define CAN_NODE_ID_MIN 1 // node 0 is reserved for broadcasts
+#define CAN_NODE_ID_MAX 63
+// Broadcast by the host, no payload. It has the highest priority on the bus,
+// and all boards receive it at the same time.
+#define CAN_SYNC_ID 0x000
+#define CAN_MOTOR_SHIFT 4
+#define CAN_MSG_MASK 0xF
+
+typedef enum {
+    // tx: int32 error, uint8 control_mode,
+    //     uint8 flags (bit 0: enable_control, 1: calibration_ok, 2: thread_ready), uint16 gate_driver_fault
+    CAN_MSG_STATUS = 0x0,
+    // rx: float pos_setpoint [counts], float vel_feed_forward [counts/s]
+    CAN_MSG_SET_POS = 0x1,
+    // rx: float vel_setpoint [counts/s], float current_feed_forward [A]
+    CAN_MSG_SET_VEL = 0x2,
+    // rx: float current_setpoint [A]
+    CAN_MSG_SET_CURRENT = 0x3,
+    // tx: float pll_pos [counts], float pll_vel [counts/s]
+    CAN_MSG_POS_VEL = 0x4,
+    // tx: float Iq_measured [A], float Ibus [A]
+    CAN_MSG_CURRENT = 0x5,
+    // tx: the variables mapped into PDO n are sent as CAN_MSG_PDO + n with motor bit 0,
+    //     packed in mapping order, see var_size
+    CAN_MSG_PDO = 0x8,
+} Can_msg_t;
+
+// Process data objects: frames with a configurable list of variables
+#define CAN_NUM_PDOS 4
+#define CAN_PDO_MAX_ENTRIES 8
+
+typedef struct {
+    int period; // [ms] 0 disables the PDO
+    // Only send when the payload differs from the last one sent.
+    // It is still checked once per period, so the period also limits the rate.
+    bool on_change;
+    int num_entries;
+    uint16_t entries[CAN_PDO_MAX_ENTRIES]; // variable IDs, see vars[]
+} Can_pdo_t;
+
+// Node ID of this board, CAN_NODE_ID_MIN to CAN_NODE_ID_MAX.
+// Applied at startup, so save the configuration and reboot after changing it.
+extern int can_node_id;
+// [ms] period of the STATUS, POS_VEL and CURRENT frames of both motors, 0 to disable
+extern int can_telemetry_period;
+// Hold received setpoints until the next SYNC frame, which applies them on all boards
+// at once, and phase lock the PWM to the SYNC frames (see pwm_sync_cb)
+extern bool can_sync;
+// Frames lost because the transmit queue was full, e.g. without a bus connection
+extern int can_tx_dropped;
+// Mapping of the PDOs, change it with can_set_pdo
+extern Can_pdo_t can_pdos[CAN_NUM_PDOS];
+// [%] share of the 1 Mbit/s bus taken by the frames this board sends, worst case bit stuffing
+extern float can_bus_load;
+
+// Replaces the mapping of a PDO, the payload of the entries must fit in 8 bytes.
+// Returns false and leaves the PDO as it was if the mapping is invalid.
+bool can_set_pdo(int pdo, int period, bool on_change, const uint16_t* entries, int num_entries);
+// [%] bus load of the current telemetry period and PDO mapping
+float can_bus_load_estimate();
+
+// Sets up the filter, starts reception and sends telemetry
+void can_thread(void const * argument);
+
+// Interrupt handlers (CAN1_TX_IRQHandler, CAN1_RX0_IRQHandler, CAN1_RX1_IRQHandler)
+void can_tx_cb();
+void can_rx_fifo0_cb();
+void can_rx_fifo1_cb();
+
+#endif //__CAN_PROTOCOL_H
@@ -0,0 +1,823 @@
+
+#include <commands.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <low_level.h>
+#include <can_protocol.h>
+#include <usbd_cdc_if.h>
+#include <cmsis_os.h>
+
+#define NUM_MONITORING_SLOTS 20
+#define NUM_SUBSCRIPTIONS 16
+#define SUBSCRIPTION_SCAN_PERIOD 10 // [ms]
+// A bulk request has to fit into one USB packet with the null termination, see CDC_Receive_FS
+#define BULK_MAX_REQUEST 63 // [bytes]
+
+#define VAR_RO(type, var, unit) {#var, type, &(var), false, unit, -INFINITY, INFINITY}
+#define VAR_RW(type, var, unit) {#var, type, &(var), true, unit, -INFINITY, INFINITY}
+#define VAR_RANGE(type, var, unit, min, max) {#var, type, &(var), true, unit, min, max}
+
+// The same variables for each entry in motors[]
+#define MOTOR_VARS(m) \
+    VAR_RW(VAR_FLOAT, motors[m].pos_setpoint, "counts"), \
+    VAR_RW(VAR_FLOAT, motors[m].pos_gain, "1/s"), \
+    VAR_RW(VAR_FLOAT, motors[m].vel_setpoint, "counts/s"), \
+    VAR_RW(VAR_FLOAT, motors[m].vel_gain, "A/(counts/s)"), \
+    VAR_RW(VAR_FLOAT, motors[m].vel_integrator_gain, "A/counts"), \
+    VAR_RW(VAR_FLOAT, motors[m].vel_integrator_current, "A"), \
+    VAR_RANGE(VAR_FLOAT, motors[m].vel_limit, "counts/s", 0.0f, INFINITY), \
+    VAR_RW(VAR_FLOAT, motors[m].current_setpoint, "A"), \
+    VAR_RANGE(VAR_FLOAT, motors[m].calibration_current, "A", 0.0f, INFINITY), \
+    VAR_RO(VAR_FLOAT, motors[m].phase_inductance, "H"), \
+    VAR_RO(VAR_FLOAT, motors[m].phase_resistance, "ohm"), \
+    VAR_RANGE(VAR_FLOAT, motors[m].dead_time_comp, "clocks", 0.0f, INFINITY), \
+    VAR_RANGE(VAR_FLOAT, motors[m].dead_time_comp_band, "A", 0.0f, INFINITY), \
+    VAR_RO(VAR_FLOAT, motors[m].current_meas.phB, "A"), \
+    VAR_RO(VAR_FLOAT, motors[m].current_meas.phC, "A"), \
+    VAR_RW(VAR_FLOAT, motors[m].DC_calib.phB, "A"), \
+    VAR_RW(VAR_FLOAT, motors[m].DC_calib.phC, "A"), \
+    VAR_RW(VAR_FLOAT, motors[m].shunt_conductance, "1/ohm"), \
+    VAR_RW(VAR_FLOAT, motors[m].phase_current_rev_gain, ""), \
+    VAR_RANGE(VAR_FLOAT, motors[m].current_control.current_lim, "A", 0.0f, INFINITY), \
+    VAR_RANGE(VAR_FLOAT, motors[m].current_control.max_modulation, "", 0.0f, 1.0f), \
+    VAR_RW(VAR_FLOAT, motors[m].current_control.p_gain, "V/A"), \
+    VAR_RW(VAR_FLOAT, motors[m].current_control.i_gain, "V/As"), \
+    VAR_RANGE(VAR_FLOAT, motors[m].current_control.bandwidth, "rad/s", 0.0f, INFINITY), \
+    VAR_RW(VAR_FLOAT, motors[m].current_control.v_current_control_integral_d, "V"), \
+    VAR_RW(VAR_FLOAT, motors[m].current_control.v_current_control_integral_q, "V"), \
+    VAR_RO(VAR_FLOAT, motors[m].current_control.Ibus, "A"), \
+    VAR_RO(VAR_FLOAT, motors[m].power.electrical_power, "W"), \
+    VAR_RO(VAR_FLOAT, motors[m].power.copper_loss, "W"), \
+    VAR_RO(VAR_FLOAT, motors[m].power.efficiency, ""), \
+    VAR_RO(VAR_FLOAT, motors[m].power.Irms, "A"), \
+    VAR_RW(VAR_FLOAT, motors[m].power.energy_in.sum, "J"), \
+    VAR_RW(VAR_FLOAT, motors[m].power.energy_out.sum, "J"), \
+    VAR_RO(VAR_FLOAT, motors[m].rotor.phase, "rad"), \
+    VAR_RW(VAR_FLOAT, motors[m].rotor.pll_pos, "counts"), \
+    VAR_RW(VAR_FLOAT, motors[m].rotor.pll_vel, "counts/s"), \
+    VAR_RW(VAR_FLOAT, motors[m].rotor.pll_kp, "1/s"), \
+    VAR_RW(VAR_FLOAT, motors[m].rotor.pll_ki, "1/s^2"), \
+    VAR_RW(VAR_FLOAT, motors[m].sensorless.pm_flux_linkage, "Vs/rad"), \
+    VAR_RW(VAR_FLOAT, motors[m].sensorless.observer_gain, "rad/s"), \
+    VAR_RO(VAR_FLOAT, motors[m].sensorless.pll_vel, "rad/s"), \
+    VAR_RW(VAR_FLOAT, motors[m].sensorless.spin_up_current, "A"), \
+    VAR_RW(VAR_FLOAT, motors[m].sensorless.spin_up_acceleration, "rad/s^2"), \
+    VAR_RW(VAR_FLOAT, motors[m].sensorless.spin_up_target_vel, "rad/s"), \
+    VAR_RO(VAR_FLOAT, motors[m].rotor.edge_vel, "counts/s"), \
+    VAR_RO(VAR_FLOAT, motors[m].fet_thermistor.temperature, "degC"), \
+    VAR_RW(VAR_FLOAT, motors[m].fet_temp_derate_start, "degC"), \
+    VAR_RW(VAR_FLOAT, motors[m].fet_temp_derate_stop, "degC"), \
+    VAR_RANGE(VAR_FLOAT, motors[m].step_filter.kp, "1/s", 0.0f, INFINITY), \
+    VAR_RANGE(VAR_FLOAT, motors[m].step_filter.ki, "1/s^2", 0.0f, INFINITY), \
+    VAR_RO(VAR_FLOAT, motors[m].step_filter.vel, "counts/s"), \
+    VAR_RANGE(VAR_INT, motors[m].control_mode, "", CTRL_MODE_VOLTAGE_CONTROL, CTRL_MODE_POSITION_CONTROL), \
+    VAR_RW(VAR_INT, motors[m].rotor.encoder_offset, "counts"), \
+    VAR_RO(VAR_INT, motors[m].rotor.encoder_state, "counts"), \
+    VAR_RW(VAR_INT, motors[m].error, ""), \
+    VAR_RO(VAR_INT, motors[m].gate_driver_fault, ""), \
+    VAR_RO(VAR_BOOL, motors[m].thread_ready, ""), \
+    VAR_RW(VAR_BOOL, motors[m].enable_control, ""), \
+    VAR_RW(VAR_BOOL, motors[m].do_calibration, ""), \
+    VAR_RO(VAR_BOOL, motors[m].calibration_ok, ""), \
+    VAR_RW(VAR_BOOL, motors[m].phase_params_valid, ""), \
+    VAR_RW(VAR_BOOL, motors[m].sensorless_mode, ""), \
+    VAR_RW(VAR_BOOL, motors[m].rotor.use_index, ""), \
+    VAR_RO(VAR_BOOL, motors[m].rotor.index_found, ""), \
+    VAR_RW(VAR_BOOL, motors[m].rotor.index_offset_valid, ""), \
+    VAR_RW(VAR_BOOL, motors[m].current_control.overmodulation, ""), \
+    VAR_RW(VAR_BOOL, motors[m].discontinuous_pwm, ""), \
+    VAR_RO(VAR_BOOL, motors[m].fet_thermistor.valid, ""), \
+    VAR_RW(VAR_BOOL, motors[m].fet_temp_derating, ""), \
+    VAR_RW(VAR_BOOL, motors[m].step_filter.enabled, ""), \
+    VAR_RW(VAR_UINT16, motors[m].control_deadline, "clocks"), \
+    VAR_RO(VAR_UINT16, motors[m].last_cpu_time, "clocks")
+
+const Var_t vars[] = {
+    VAR_RO(VAR_FLOAT, vbus_voltage, "V"),
+    VAR_RO(VAR_FLOAT, elec_rad_per_enc, "rad/counts"),
+    VAR_RO(VAR_FLOAT, vbus_voltage_raw, "V"),
+    VAR_RW(VAR_FLOAT, vbus_ripple_ff_gain, ""),
+    VAR_RO(VAR_FLOAT, aux_thermistor.temperature, "degC"),
+    VAR_RANGE(VAR_FLOAT, brake.resistance, "ohm", 0.0f, INFINITY),
+    VAR_RANGE(VAR_FLOAT, brake.power_rating, "W", 0.0f, INFINITY),
+    VAR_RANGE(VAR_FLOAT, brake.thermal_time_constant, "s", 0.1f, INFINITY),
+    VAR_RW(VAR_FLOAT, brake.vbus_brake_start, "V"),
+    VAR_RW(VAR_FLOAT, brake.vbus_overvoltage_trip, "V"),
+    VAR_RW(VAR_FLOAT, brake.vbus_p_gain, "A/V"),
+    VAR_RW(VAR_FLOAT, brake.vbus_i_gain, "A/Vs"),
+    VAR_RO(VAR_FLOAT, brake.current, "A"),
+    VAR_RO(VAR_FLOAT, brake.energy, "J"),
+    VAR_RO(VAR_FLOAT, can_bus_load, "%"),
+    VAR_RO(VAR_INT, boot_to_ready_time, "ms"),
+    VAR_RANGE(VAR_INT, pwm_frequency, "Hz", PWM_FREQUENCY_MIN, PWM_FREQUENCY_MAX),
+    VAR_RANGE(VAR_INT, can_node_id, "", CAN_NODE_ID_MIN, CAN_NODE_ID_MAX),
+    VAR_RANGE(VAR_INT, can_telemetry_period, "ms", 0, INFINITY),
+    VAR_RO(VAR_INT, can_tx_dropped, ""),
+    VAR_RO(VAR_INT, pwm_sync.phase_error, "clocks"),
+    VAR_RO(VAR_BOOL, aux_thermistor.valid, ""),
+    VAR_RW(VAR_BOOL, brake.enabled, ""),
+    VAR_RW(VAR_BOOL, can_sync, ""),
+    VAR_RO(VAR_BOOL, pwm_sync.locked, ""),
+    VAR_RW(VAR_BOOL, step_counter.enabled, ""),
+    MOTOR_VARS(0),
+    MOTOR_VARS(1),
+};
+
+const int num_vars = sizeof(vars)/sizeof(vars[0]);
+
+static const char* const var_type_names[] = {"float", "int", "bool", "uint16"};
+
+// Addressing by type and index (`g 0 12`) as in the original exposed variable tables,
+// so hosts written against them keep working. Entries are only ever appended here,
+// an index never changes its meaning. Variables missing here are only reachable by ID.
+static void* const legacy_floats[] = {
+    &vbus_voltage,
+    &elec_rad_per_enc,
+    &motors[0].pos_setpoint,
+    &motors[0].pos_gain,
+    &motors[0].vel_setpoint,
+    &motors[0].vel_gain,
+    &motors[0].vel_integrator_gain,
+    &motors[0].vel_integrator_current,
+    &motors[0].vel_limit,
+    &motors[0].current_setpoint,
+    &motors[0].calibration_current,
+    &motors[0].phase_inductance,
+    &motors[0].phase_resistance,
+    &motors[0].current_meas.phB,
+    &motors[0].current_meas.phC,
+    &motors[0].DC_calib.phB,
+    &motors[0].DC_calib.phC,
+    &motors[0].shunt_conductance,
+    &motors[0].phase_current_rev_gain,
+    &motors[0].current_control.current_lim,
+    &motors[0].current_control.p_gain,
+    &motors[0].current_control.i_gain,
+    &motors[0].current_control.v_current_control_integral_d,
+    &motors[0].current_control.v_current_control_integral_q,
+    &motors[0].current_control.Ibus,
+    &motors[0].rotor.phase,
+    &motors[0].rotor.pll_pos,
+    &motors[0].rotor.pll_vel,
+    &motors[0].rotor.pll_kp,
+    &motors[0].rotor.pll_ki,
+    &motors[1].pos_setpoint,
+    &motors[1].pos_gain,
+    &motors[1].vel_setpoint,
+    &motors[1].vel_gain,
+    &motors[1].vel_integrator_gain,
+    &motors[1].vel_integrator_current,
+    &motors[1].vel_limit,
+    &motors[1].current_setpoint,
+    &motors[1].calibration_current,
+    &motors[1].phase_inductance,
+    &motors[1].phase_resistance,
+    &motors[1].current_meas.phB,
+    &motors[1].current_meas.phC,
+    &motors[1].DC_calib.phB,
+    &motors[1].DC_calib.phC,
+    &motors[1].shunt_conductance,
+    &motors[1].phase_current_rev_gain,
+    &motors[1].current_control.current_lim,
+    &motors[1].current_control.p_gain,
+    &motors[1].current_control.i_gain,
+    &motors[1].current_control.v_current_control_integral_d,
+    &motors[1].current_control.v_current_control_integral_q,
+    &motors[1].current_control.Ibus,
+    &motors[1].rotor.phase,
+    &motors[1].rotor.pll_pos,
+    &motors[1].rotor.pll_vel,
+    &motors[1].rotor.pll_kp,
+    &motors[1].rotor.pll_ki,
+    &motors[0].sensorless.pm_flux_linkage,
+    &motors[0].sensorless.observer_gain,
+    &motors[0].sensorless.pll_vel,
+    &motors[0].sensorless.spin_up_current,
+    &motors[0].sensorless.spin_up_acceleration,
+    &motors[0].sensorless.spin_up_target_vel,
+    &motors[1].sensorless.pm_flux_linkage,
+    &motors[1].sensorless.observer_gain,
+    &motors[1].sensorless.pll_vel,
+    &motors[1].sensorless.spin_up_current,
+    &motors[1].sensorless.spin_up_acceleration,
+    &motors[1].sensorless.spin_up_target_vel,
+    &motors[0].rotor.edge_vel,
+    &motors[1].rotor.edge_vel,
+    &vbus_voltage_raw,
+    &vbus_ripple_ff_gain,
+    &motors[0].dead_time_comp,
+    &motors[0].dead_time_comp_band,
+    &motors[1].dead_time_comp,
+    &motors[1].dead_time_comp_band,
+    &motors[0].current_control.max_modulation,
+    &motors[1].current_control.max_modulation,
+    &motors[0].current_control.bandwidth,
+    &motors[1].current_control.bandwidth,
+    &aux_thermistor.temperature,
+    &motors[0].fet_thermistor.temperature,
+    &motors[0].fet_temp_derate_start,
+    &motors[0].fet_temp_derate_stop,
+    &motors[1].fet_thermistor.temperature,
+    &motors[1].fet_temp_derate_start,
+    &motors[1].fet_temp_derate_stop,
+    &brake.resistance,
+    &brake.power_rating,
+    &brake.thermal_time_constant,
+    &brake.vbus_brake_start,
+    &brake.vbus_overvoltage_trip,
+    &brake.vbus_p_gain,
+    &brake.vbus_i_gain,
+    &brake.current,
+    &brake.energy,
+    &motors[0].power.electrical_power,
+    &motors[0].power.copper_loss,
+    &motors[0].power.efficiency,
+    &motors[0].power.Irms,
+    &motors[0].power.energy_in.sum,
+    &motors[0].power.energy_out.sum,
+    &motors[1].power.electrical_power,
+    &motors[1].power.copper_loss,
+    &motors[1].power.efficiency,
+    &motors[1].power.Irms,
+    &motors[1].power.energy_in.sum,
+    &motors[1].power.energy_out.sum,
+    &can_bus_load,
+    &motors[0].step_filter.kp,
+    &motors[0].step_filter.ki,
+    &motors[0].step_filter.vel,
+    &motors[1].step_filter.kp,
+    &motors[1].step_filter.ki,
+    &motors[1].step_filter.vel,
+};
+
+static void* const legacy_ints[] = {
+    &motors[0].control_mode,
+    &motors[0].rotor.encoder_offset,
+    &motors[0].rotor.encoder_state,
+    &motors[0].error,
+    &motors[1].control_mode,
+    &motors[1].rotor.encoder_offset,
+    &motors[1].rotor.encoder_state,
+    &motors[1].error,
+    &boot_to_ready_time,
+    &pwm_frequency,
+    &motors[0].gate_driver_fault,
+    &motors[1].gate_driver_fault,
+    &can_node_id,
+    &can_telemetry_period,
+    &can_tx_dropped,
+    &pwm_sync.phase_error,
+};
+
+static void* const legacy_bools[] = {
+    &motors[0].thread_ready,
+    &motors[0].enable_control,
+    &motors[0].do_calibration,
+    &motors[0].calibration_ok,
+    &motors[1].thread_ready,
+    &motors[1].enable_control,
+    &motors[1].do_calibration,
+    &motors[1].calibration_ok,
+    &motors[0].phase_params_valid,
+    &motors[1].phase_params_valid,
+    &motors[0].sensorless_mode,
+    &motors[1].sensorless_mode,
+    &motors[0].rotor.use_index,
+    &motors[0].rotor.index_found,
+    &motors[0].rotor.index_offset_valid,
+    &motors[1].rotor.use_index,
+    &motors[1].rotor.index_found,
+    &motors[1].rotor.index_offset_valid,
+    &motors[0].current_control.overmodulation,
+    &motors[1].current_control.overmodulation,
+    &motors[0].discontinuous_pwm,
+    &motors[1].discontinuous_pwm,
+    &aux_thermistor.valid,
+    &motors[0].fet_thermistor.valid,
+    &motors[0].fet_temp_derating,
+    &motors[1].fet_thermistor.valid,
+    &motors[1].fet_temp_derating,
+    &brake.enabled,
+    &can_sync,
+    &pwm_sync.locked,
+    &step_counter.enabled,
+    &motors[0].step_filter.enabled,
+    &motors[1].step_filter.enabled,
+};
+
+static void* const legacy_uint16s[] = {
+    &motors[0].control_deadline,
+    &motors[0].last_cpu_time,
+    &motors[1].control_deadline,
+    &motors[1].last_cpu_time,
+};
+
+static void* const* const legacy_tables[] = {legacy_floats, legacy_ints, legacy_bools, legacy_uint16s};
+static const int legacy_table_sizes[] = {
+    sizeof(legacy_floats) / sizeof(legacy_floats[0]),
+    sizeof(legacy_ints) / sizeof(legacy_ints[0]),
+    sizeof(legacy_bools) / sizeof(legacy_bools[0]),
+    sizeof(legacy_uint16s) / sizeof(legacy_uint16s[0]),
+};
+
+// Variable IDs, printed by the `o` command
+static int monitoring_slots[NUM_MONITORING_SLOTS] = {0};
+
+// Variables whose changes are pushed to the host, see subscription_thread
+typedef struct {
+    bool active;
+    int id;
+    float deadband; // 0 notifies on any change
+    bool notified; // last holds the value of the last notification
+    uint8_t last[4]; // in the format of var_read
+} Subscription_t;
+
+static Subscription_t subscriptions[NUM_SUBSCRIPTIONS];
+// Counts the notifications sent, so the host can tell their order
+static uint32_t notification_seq = 0;
+
+int var_size(int id) {
+    if (id < 0 || id >= num_vars)
+        return 0;
+    switch (vars[id].type) {
+    case VAR_FLOAT: return sizeof(float);
+    case VAR_INT: return sizeof(int32_t);
+    case VAR_BOOL: return 1;
+    case VAR_UINT16: return sizeof(uint16_t);
+    default: return 0;
+    }
+}
+
+int var_read(int id, void* data) {
+    int size = var_size(id);
+    if (size == 0)
+        return 0;
+    const Var_t* var = &vars[id];
+    if (var->type == VAR_BOOL) {
+        uint8_t value = *(bool*)var->ptr ? 1 : 0;
+        memcpy(data, &value, 1);
+    } else {
+        // float, int and uint16 have the same representation here and on the wire
+        memcpy(data, var->ptr, size);
+    }
+    return size;
+}
+
+// ID of the variable at index in the legacy table of the type (0 float, 1 int, 2 bool, 3 uint16),
+// -1 if there is none
+static int legacy_var_id(int type, int index) {
+    if (type < 0 || type > VAR_UINT16 || index < 0 || index >= legacy_table_sizes[type])
+        return -1;
+    void* ptr = legacy_tables[type][index];
+    for (int id = 0; id < num_vars; ++id) {
+        if (vars[id].ptr == ptr && vars[id].type == (Var_type_t)type)
+            return id;
+    }
+    return -1;
+}
+
+// Number of whitespace separated arguments after the command letter
+static int count_args(const char* str) {
+    int count = 0;
+    bool in_arg = false;
+    for (const char* c = str + 1; *c; ++c) {
+        bool space = (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n');
+        if (!space && !in_arg)
+            ++count;
+        in_arg = !space;
+    }
+    return count;
+}
+
+// Converts a value in the format of var_read
+static float var_value_float(const Var_t* var, const uint8_t* data) {
+    switch (var->type) {
+    case VAR_FLOAT: {
+        float value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    case VAR_INT: {
+        int32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    case VAR_UINT16: {
+        uint16_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    default:
+        return data[0]; // bool
+    }
+}
+
+// Formats a value in the format of var_read as text, the way the g command prints it
+static int var_value_string(const Var_t* var, const uint8_t* data, char* str, int size) {
+    switch (var->type) {
+    case VAR_FLOAT:
+        return snprintf(str, size, "%f", var_value_float(var, data));
+    case VAR_INT: {
+        int32_t value;
+        memcpy(&value, data, sizeof(value));
+        return snprintf(str, size, "%ld", (long)value);
+    }
+    default:
+        return snprintf(str, size, "%u", (unsigned)var_value_float(var, data));
+    }
+}
+
+// Checks a value in the format of var_read before var_write_value writes it
+static bool var_value_valid(const Var_t* var, const uint8_t* data) {
+    if (!var->writable)
+        return false;
+    if (var->type == VAR_BOOL)
+        return true;
+    float value = var_value_float(var, data);
+    return value >= var->min && value <= var->max;
+}
+
+static void var_write_value(const Var_t* var, const uint8_t* data) {
+    if (var->type == VAR_BOOL)
+        *(bool*)var->ptr = data[0] != 0;
+    else
+        memcpy(var->ptr, data, var_size(var - vars));
+}
+
+bool var_write_string(int id, const char* str) {
+    if (id < 0 || id >= num_vars || !vars[id].writable)
+        return false;
+    const Var_t* var = &vars[id];
+    char* end;
+    float value;
+    if (var->type == VAR_FLOAT)
+        value = strtof(str, &end);
+    else
+        value = strtol(str, &end, 10);
+    if (end == str)
+        return false;
+    if (var->type != VAR_BOOL && !(value >= var->min && value <= var->max))
+        return false;
+
+    switch (var->type) {
+    case VAR_FLOAT:
+        *(float*)var->ptr = value;
+        break;
+    case VAR_INT:
+        *(int*)var->ptr = strtol(str, NULL, 10);
+        break;
+    case VAR_BOOL:
+        *(bool*)var->ptr = value != 0.0f;
+        break;
+    case VAR_UINT16:
+        if (value < 0.0f || value > UINT16_MAX)
+            return false;
+        *(uint16_t*)var->ptr = strtol(str, NULL, 10);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// G n id...: n uint16 variable IDs, little endian.
+// Replies with a G followed by the values packed in order (see var_read), or 0 and a newline
+// like S if an ID is unknown or the request is cut short. The values are read with interrupts
+// disabled, so they are from the same control cycle.
+static void bulk_read(const uint8_t* request, int len) {
+    uint8_t reply[1 + 4 * BULK_MAX_REQUEST / 2];
+    int n = request[1];
+    if (len < 2 + 2 * n || 1 + 4 * n > (int)sizeof(reply)) {
+        printf("0\n");
+        return;
+    }
+    // The G tells the reply apart from notifications, which start with !
+    reply[0] = 'G';
+    int reply_len = 1;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (int i = 0; i < n; ++i) {
+        uint16_t id;
+        memcpy(&id, &request[2 + 2 * i], sizeof(id));
+        int size = var_read(id, &reply[reply_len]);
+        if (size == 0) {
+            reply_len = 0;
+            break;
+        }
+        reply_len += size;
+    }
+    __set_PRIMASK(primask);
+    if (reply_len > 0)
+        usb_tx_queue(reply, reply_len);
+    else
+        printf("0\n");
+}
+
+// S n (id value)...: n pairs of a uint16 variable ID and its value in the format of var_read.
+// Either all values are written, with interrupts disabled so the control loop sees all or
+// none of them, or none if any ID is unknown, read only or its value is out of range.
+// Replies 1 if they were written, 0 otherwise.
+static bool bulk_write(const uint8_t* request, int len) {
+    int n = request[1];
+    int pos = 2;
+    for (int i = 0; i < n; ++i) {
+        uint16_t id;
+        if (pos + 2 > len)
+            return false;
+        memcpy(&id, &request[pos], sizeof(id));
+        int size = var_size(id);
+        if (size == 0 || pos + 2 + size > len || !var_value_valid(&vars[id], &request[pos + 2]))
+            return false;
+        pos += 2 + size;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    pos = 2;
+    for (int i = 0; i < n; ++i) {
+        uint16_t id;
+        memcpy(&id, &request[pos], sizeof(id));
+        var_write_value(&vars[id], &request[pos + 2]);
+        pos += 2 + var_size(id);
+    }
+    __set_PRIMASK(primask);
+    return true;
+}
+
+// Pushes changes of the variable to the host, or updates the deadband if it is already
+// subscribed. The current value is always sent first. False if the ID is unknown, the
+// deadband negative or all slots are taken.
+static bool subscribe(int id, float deadband) {
+    if (var_size(id) == 0 || !(deadband >= 0.0f))
+        return false;
+    Subscription_t* free_slot = NULL;
+    for (int i = 0; i < NUM_SUBSCRIPTIONS; ++i) {
+        if (subscriptions[i].active && subscriptions[i].id == id) {
+            free_slot = &subscriptions[i];
+            break;
+        }
+        if (!subscriptions[i].active && free_slot == NULL)
+            free_slot = &subscriptions[i];
+    }
+    if (free_slot == NULL)
+        return false;
+    // subscription_thread copies the slot under the same lock
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    free_slot->id = id;
+    free_slot->deadband = deadband;
+    free_slot->notified = false;
+    free_slot->active = true;
+    __set_PRIMASK(primask);
+    return true;
+}
+
+// Stops the notifications of a variable, of all variables if id is negative
+static void unsubscribe(int id) {
+    for (int i = 0; i < NUM_SUBSCRIPTIONS; ++i) {
+        if (id < 0 || subscriptions[i].id == id)
+            subscriptions[i].active = false;
+    }
+}
+
+static bool value_changed(const Subscription_t* sub, const uint8_t* value) {
+    const Var_t* var = &vars[sub->id];
+    if (memcmp(sub->last, value, var_size(sub->id)) == 0)
+        return false;
+    if (sub->deadband > 0.0f && var->type != VAR_BOOL)
+        return fabsf(var_value_float(var, value) - var_value_float(var, sub->last)) > sub->deadband;
+    return true;
+}
+
+// subscription_thread formats its lines with these instead of stdio: newlib keeps the
+// printf state in one structure for all threads (configUSE_NEWLIB_REENTRANT is off),
+// and the USB thread prints the command replies.
+static char* append_uint(char* str, uint32_t value) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0)
+        *str++ = digits[--n];
+    return str;
+}
+
+static char* append_hex(char* str, const uint8_t* data, int size) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (int i = 0; i < size; ++i) {
+        *str++ = hex_digits[data[i] >> 4];
+        *str++ = hex_digits[data[i] & 0xF];
+    }
+    return str;
+}
+
+static void scan_subscription(Subscription_t* slot, uint32_t now) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    Subscription_t sub = *slot;
+    __set_PRIMASK(primask);
+    if (!sub.active)
+        return;
+
+    uint8_t value[4];
+    var_read(sub.id, value);
+    if (sub.notified && !value_changed(&sub, value))
+        return;
+
+    // ! seq time id value, the value as the hex bytes of var_read
+    char line[48];
+    char* end = line;
+    *end++ = '!';
+    *end++ = ' ';
+    end = append_uint(end, notification_seq);
+    *end++ = ' ';
+    end = append_uint(end, now);
+    *end++ = ' ';
+    end = append_uint(end, sub.id);
+    *end++ = ' ';
+    end = append_hex(end, value, var_size(sub.id));
+    *end++ = '\n';
+    // If the queue is full, the change is sent on one of the next scans
+    if (!usb_tx_queue((uint8_t*)line, end - line))
+        return;
+    ++notification_seq;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (slot->active && slot->id == sub.id) {
+        memcpy(slot->last, value, sizeof(value));
+        slot->notified = true;
+    }
+    __set_PRIMASK(primask);
+}
+
+void subscription_thread(void const * argument) {
+    uint32_t last_wake = osKernelSysTick();
+    for (;;) {
+        uint32_t now = osKernelSysTick();
+        for (int i = 0; i < NUM_SUBSCRIPTIONS; ++i)
+            scan_subscription(&subscriptions[i], now);
+        osDelayUntil(&last_wake, SUBSCRIPTION_SCAN_PERIOD);
+    }
+
+    // If we get here, then this task is done
+    vTaskDelete(osThreadGetId());
+}
+
+static void print_var(int id, const char* separator) {
+    uint8_t value[4];
+    char str[48];
+    var_read(id, value);
+    var_value_string(&vars[id], value, str, sizeof(str));
+    printf("%s%s", str, separator);
+}
+
+static void print_monitoring(int limit) {
+    if (limit > NUM_MONITORING_SLOTS)
+        limit = NUM_MONITORING_SLOTS;
+    for (int i = 0; i < limit; i++) {
+        if (monitoring_slots[i] < 0 || monitoring_slots[i] >= num_vars)
+            break;
+        print_var(monitoring_slots[i], "\t");
+    }
+    printf("\n");
+}
+
+void motor_parse_cmd(uint8_t* buffer, int len) {
+
+    // TODO very hacky way of terminating sscanf at end of buffer:
+    // We should do some proper struct packing instead of using sscanf altogether
+    buffer[len] = 0;
+
+    // check incoming packet type
+    if (buffer[0] == 'p') {
+        // position control
+        unsigned motor_number;
+        float pos_setpoint, vel_feed_forward, current_feed_forward;
+        int numscan = sscanf((const char*)buffer, "p %u %f %f %f", &motor_number, &pos_setpoint, &vel_feed_forward, &current_feed_forward);
+        if (numscan == 4 && motor_number < num_motors) {
+            set_pos_setpoint(&motors[motor_number], pos_setpoint, vel_feed_forward, current_feed_forward);
+        }
+    } else if (buffer[0] == 'v') {
+        // velocity control
+        unsigned motor_number;
+        float vel_feed_forward, current_feed_forward;
+        int numscan = sscanf((const char*)buffer, "v %u %f %f", &motor_number, &vel_feed_forward, &current_feed_forward);
+        if (numscan == 3 && motor_number < num_motors) {
+            set_vel_setpoint(&motors[motor_number], vel_feed_forward, current_feed_forward);
+        }
+    } else if (buffer[0] == 'c') {
+        // current control
+        unsigned motor_number;
+        float current_feed_forward;
+        int numscan = sscanf((const char*)buffer, "c %u %f", &motor_number, &current_feed_forward);
+        if (numscan == 2 && motor_number < num_motors) {
+            set_current_setpoint(&motors[motor_number], current_feed_forward);
+        }
+    } else if (buffer[0] == 'l') { // List variables
+        // l: number of variables
+        // l id: name type access unit min max, unit is "-" if there is none
+        int id = 0;
+        int numscan = sscanf((const char*)buffer, "l %d", &id);
+        if (numscan != 1) {
+            printf("%d\n", num_vars);
+        } else if (id >= 0 && id < num_vars) {
+            const Var_t* var = &vars[id];
+            printf("%s %s %s %s %g %g\n", var->name, var_type_names[var->type],
+                    var->writable ? "rw" : "ro", var->unit[0] ? var->unit : "-", var->min, var->max);
+        }
+    } else if (buffer[0] == 'g') { // GET
+        // g id, or g type index
+        int id = 0;
+        int index = 0;
+        int numscan = sscanf((const char*)buffer, "g %d %d", &id, &index);
+        if (numscan == 2)
+            id = legacy_var_id(id, index);
+        if (numscan >= 1 && id >= 0 && id < num_vars) {
+            print_var(id, "\n");
+        }
+    } else if (buffer[0] == 's') { // SET
+        // s id value, or s type index value
+        // prints 1 if the value was written, 0 otherwise
+        int id = 0;
+        int index = 0;
+        int pos = 0;
+        int numscan;
+        if (count_args((const char*)buffer) == 3) {
+            numscan = sscanf((const char*)buffer, "s %d %d%n", &id, &index, &pos) - 1;
+            id = legacy_var_id(id, index);
+        } else {
+            numscan = sscanf((const char*)buffer, "s %d%n", &id, &pos);
+        }
+        printf("%d\n", numscan == 1 && var_write_string(id, (const char*)buffer + pos));
+    } else if (buffer[0] == 'm') { // Setup Monitor
+        // m id monitoring_slot, or m type index monitoring_slot
+        int id = 0;
+        int index = 0;
+        int slot = 0;
+        int numscan;
+        if (count_args((const char*)buffer) == 3) {
+            numscan = sscanf((const char*)buffer, "m %d %d %d", &id, &index, &slot) - 1;
+            id = legacy_var_id(id, index);
+        } else {
+            numscan = sscanf((const char*)buffer, "m %d %d", &id, &slot);
+        }
+        if (numscan == 2 && slot >= 0 && slot < NUM_MONITORING_SLOTS) {
+            monitoring_slots[slot] = id;
+        }
+    } else if (buffer[0] == 'o') { // Output Monitor
+        int limit = 0;
+        int numscan = sscanf((const char*)buffer, "o %d", &limit);
+        if (numscan == 1) {
+            print_monitoring(limit);
+        }
+    } else if (buffer[0] == 'P') { // Map a CAN PDO
+        // P pdo period_ms on_change [id]...
+        // prints the new bus load in %, or -1 if the mapping was rejected
+        int pdo = 0;
+        int period = 0;
+        int on_change = 0;
+        int pos = 0;
+        int numscan = sscanf((const char*)buffer, "P %d %d %d%n", &pdo, &period, &on_change, &pos);
+        if (numscan == 3) {
+            uint16_t ids[CAN_PDO_MAX_ENTRIES];
+            int num_entries = 0;
+            bool valid = true;
+            int id, id_len;
+            while (sscanf((const char*)buffer + pos, "%d%n", &id, &id_len) == 1) {
+                if (num_entries == CAN_PDO_MAX_ENTRIES || id < 0 || id >= num_vars) {
+                    valid = false;
+                    break;
+                }
+                ids[num_entries++] = id;
+                pos += id_len;
+            }
+            if (valid && can_set_pdo(pdo, period, on_change, ids, num_entries))
+                printf("%f\n", can_bus_load_estimate());
+            else
+                printf("%f\n", -1.0f);
+        }
+    } else if (buffer[0] == 'G') { // Bulk binary read
+        bulk_read(buffer, len);
+    } else if (buffer[0] == 'S' && len >= 2) { // Bulk binary write
+        printf("%d\n", bulk_write(buffer, len));
+    } else if (buffer[0] == 'n') { // Subscribe to changes
+        int id;
+        float deadband = 0.0f;
+        int numscan = sscanf((const char*)buffer, "n %d %f", &id, &deadband);
+        printf("%d\n", numscan >= 1 && subscribe(id, deadband));
+    } else if (buffer[0] == 'u') { // Unsubscribe
+        int id = -1;
+        sscanf((const char*)buffer, "u %d", &id);
+        unsubscribe(id);
+    } else if (buffer[0] == 'W') { // Write configuration to flash
+        printf("%d\n", save_configuration());
+    } else if (buffer[0] == 'D') { // Delete configuration from flash
+        printf("%d\n", erase_configuration());
+    }
+}
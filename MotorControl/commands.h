@@ -0,0 +1,45 @@
+
+#ifndef __COMMANDS_H
+#define __COMMANDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Registry of the variables the host can read and write over USB and map into CAN PDOs.
+// A variable is addressed by its ID, the position in vars[]. The IDs change whenever the
+// table changes, so hosts look them up by name at connect time with the `l` command.
+
+typedef enum {
+    VAR_FLOAT,
+    VAR_INT,
+    VAR_BOOL,
+    VAR_UINT16,
+} Var_type_t;
+
+typedef struct {
+    const char* name; // the C expression of the variable, e.g. "motors[0].pos_gain"
+    Var_type_t type;
+    void* ptr;
+    bool writable;
+    const char* unit; // "" if it has none
+    float min; // writes outside [min, max] are refused, not used for bools
+    float max;
+} Var_t;
+
+extern const Var_t vars[];
+extern const int num_vars;
+
+// Size of the value in binary transfers (CAN PDOs), 0 if there is no variable with this ID.
+// float and int take 4 bytes, uint16 2 and bool 1.
+int var_size(int id);
+// Copies the value little endian into data, returns the number of bytes written
+int var_read(int id, void* data);
+// Parses the value from text and writes it, false if the variable is read only,
+// the value is out of range or there is no such ID
+bool var_write_string(int id, const char* str);
+
+void motor_parse_cmd(uint8_t* buffer, int len);
+// Scans the subscribed variables and pushes their changes to the host over USB
+void subscription_thread(void const * argument);
+
+#endif //__COMMANDS_H
@@ -9,6 +9,7 @@
 #include <low_level.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <cmsis_os.h>
 
@@ -18,28 +19,166 @@
 #include <tim.h>
 #include <spi.h>
 #include <utils.h>
+#include <nvm.h>
+#include <can_protocol.h>
 
 /* Private defines -----------------------------------------------------------*/
 
 #define STANDALONE_MODE // Drive operates without USB communication
 // #define DEBUG_PRINT
 
+// Startup current sense offset calibration:
+// DC_calib is seeded with the mean of the DC_CAL samples once it is known
+// to within DC_CALIB_MAX_STDERR on both phases.
+#define DC_CALIB_MIN_SAMPLES 64
+#define DC_CALIB_MAX_SAMPLES 1024 // statistics are restarted after this, to forget startup transients
+#define DC_CALIB_MAX_STDERR 0.01f // [A]
+#define DC_CALIB_TIMEOUT 1500 // [ms]
+#define DC_CALIB_FILTER_TAU 0.2f // [s] tracking of DC_calib once converged
+#define VBUS_FILTER_TAU 0.001f // [s]
+// FET and aux thermistors: NTC to ground with a pull-up to the 3.3V ADC reference.
+// Values as fitted on the v3 boards, change these for other parts.
+#define THERMISTOR_R_PULLUP 10000.0f // [ohm]
+#define THERMISTOR_R25 10000.0f // [ohm] at 25degC
+#define THERMISTOR_BETA 3435.0f // [K]
+#define THERMISTOR_MIN_RATIO 0.01f // ADC readings outside of this ratio are a shorted or open sensor
+#define THERMISTOR_FILTER_TAU 0.1f // [s]
+#define POWER_FILTER_TAU 0.1f // [s] filtering of the reported power, RMS current and efficiency
+#define EFFICIENCY_MIN_POWER 1.0f // [W] efficiency is reported as 0 below this electrical power
+// PWM phase lock to the CAN SYNC, see pwm_sync_cb
+#define PWM_SYNC_P_GAIN 0.5f // fraction of the phase error corrected per SYNC
+#define PWM_SYNC_I_GAIN 0.1f // [1/SYNC]
+#define PWM_SYNC_MAX_STEP_DIV 256 // a period is lengthened or shortened by at most 1/256
+#define PWM_SYNC_LOCK_CLOCKS (TIM_1_8_CLOCK_HZ / 1000000) // [clocks] 1us
+// Compare value that never matches: the phase stays on the low side for the whole period.
+// Above any ARR, including the ones lengthened by the PWM_SYNC trim.
+#define PWM_TIMING_NEVER_MATCHES 0xFFFF // [clocks]
+// The DRV8301 holds nFAULT low with a PVDD undervoltage (below about 6V),
+// which is the normal state on USB power and while the DC bus comes up.
+#define GATE_DRIVER_MIN_VBUS 8.0f // [V]
+#define GATE_DRIVER_WAKE_TIME 10 // [ms] the bus has to be up before nFAULT is checked
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846f
 #endif
 
 /* Private macros ------------------------------------------------------------*/
 /* Private typedef -----------------------------------------------------------*/
+// Configuration stored in flash, see load_configuration and save_configuration.
+// Increment CONFIG_VERSION whenever this layout changes: a stored configuration
+// with a different version is ignored and the defaults below are used instead.
+#define CONFIG_VERSION 16
+typedef struct {
+    // Calibration results
+    bool phase_params_valid;
+    float phase_resistance;
+    float phase_inductance;
+    float dead_time_comp;
+    float current_p_gain;
+    float current_i_gain;
+    float pll_kp;
+    float pll_ki;
+    int encoder_offset;
+    int motor_dir;
+    bool index_offset_valid;
+    // User parameters
+    int control_mode;
+    float counts_per_step;
+    bool step_filter_enabled;
+    float step_filter_kp;
+    float step_filter_ki;
+    float pos_gain;
+    float vel_gain;
+    float vel_integrator_gain;
+    float vel_limit;
+    float calibration_current;
+    float current_lim;
+    float current_control_bandwidth;
+    float max_modulation;
+    bool overmodulation;
+    float dead_time_comp_band;
+    bool discontinuous_pwm;
+    bool fet_temp_derating;
+    float fet_temp_derate_start;
+    float fet_temp_derate_stop;
+    bool sensorless_mode;
+    float pm_flux_linkage;
+    float observer_gain;
+    float spin_up_current;
+    float spin_up_acceleration;
+    float spin_up_target_vel;
+    bool use_index;
+} Motor_config_t;
+
+typedef struct {
+    int pwm_frequency;
+    float brake_resistance;
+    float brake_power_rating;
+    float brake_thermal_time_constant;
+    float vbus_brake_start;
+    float vbus_overvoltage_trip;
+    float vbus_p_gain;
+    float vbus_i_gain;
+    int can_node_id;
+    int can_telemetry_period;
+    bool can_sync;
+    bool step_counter_enabled;
+    Can_pdo_t can_pdos[CAN_NUM_PDOS];
+    Motor_config_t motors[2]; // one per entry in motors[]
+} Config_t;
+
 /* Global constant data ------------------------------------------------------*/
 /* Global variables ----------------------------------------------------------*/
-// This value is updated by the DC-bus reading ADC.
+// This value is updated by the DC-bus reading ADC, low pass filtered.
 // Arbitrary non-zero inital value to avoid division by zero if ADC reading is late
 float vbus_voltage = 12.0f;
+// Last unfiltered DC-bus reading [V]
+float vbus_voltage_raw = 12.0f;
+// Fraction of the bus ripple (raw - filtered) that the modulation compensates for.
+// 0 uses the filtered voltage only, 1 uses the raw voltage (includes ADC noise).
+float vbus_ripple_ff_gain = 0.0f;
+// Time from reset until init_motor_control is done [ms]
+int boot_to_ready_time = 0;
+// PWM and current control frequency [Hz]. Applied at startup, so save the configuration and reboot after changing it.
+int pwm_frequency = TIM_1_8_CLOCK_HZ / (2 * TIM_1_8_PERIOD_CLOCKS);
+// Thermistor on the AUX_TEMP input, for the brake resistor or user wiring
+Thermistor_t aux_thermistor = {.temperature = 0.0f, .valid = false};
+// DC bus voltage regulation with the brake resistor, see update_brake
+Brake_t brake = {
+    .enabled = true, // cleared by global_fault
+    .resistance = 0.47f, // [ohm]
+    .power_rating = 50.0f, // [W]
+    .thermal_time_constant = 60.0f, // [s]
+    .vbus_brake_start = 26.0f, // [V] above the 24V supply
+    .vbus_overvoltage_trip = 30.0f, // [V] below the bus capacitor rating
+    .vbus_p_gain = 1.0f, // [A/V]
+    .vbus_i_gain = 50.0f, // [A/Vs]
+    .vbus_integral = 0.0f,
+    .current = 0.0f,
+    .energy = 0.0f
+};
+// PWM phase lock to the CAN SYNC
+Pwm_sync_t pwm_sync = {
+    .integral = 0.0f,
+    .residual = 0.0f,
+    .correction = 0,
+    .applied = 0,
+    .phase_error = 0,
+    .locked = false
+};
+// Hardware step counting for M1
+Step_counter_t step_counter = {
+    .enabled = false,
+    .active = false,
+    .dir = false,
+    .timer_count = 0,
+    .steps = 0
+};
 
 // TODO stick parameter into struct
 #define ENCODER_CPR (600*4)
 #define POLE_PAIRS 7
-static float elec_rad_per_enc = POLE_PAIRS * 2 * M_PI * (1.0f / (float)ENCODER_CPR);
+float elec_rad_per_enc = POLE_PAIRS * 2 * M_PI * (1.0f / (float)ENCODER_CPR);
 
 // TODO: Migrate to C++, clearly we are actually doing object oriented code here...
 // TODO: For nice encapsulation, consider not having the motor objects public
@@ -48,7 +187,16 @@ Motor_t motors[] = {
         .control_mode = CTRL_MODE_POSITION_CONTROL, //see: Motor_control_mode_t
         .enable_step_dir = false, //auto enabled after calibration
         .counts_per_step = 2.0f,
+        .step_filter = {
+            .enabled = true,
+            .kp = 1000.0f, // [(counts/s) / count] 500rad/s bandwidth
+            .ki = 250000.0f, // [(counts/s^2) / count] critically damped
+            .input = 0.0f,
+            .error = 0.0f,
+            .vel = 0.0f,
+        },
         .error = ERROR_NO_ERROR,
+        .gate_driver_fault = 0,
         .pos_setpoint = 0.0f,
         .pos_gain = 20.0f, // [(counts/s) / counts]
         .vel_setpoint = 0.0f,
@@ -60,6 +208,14 @@ Motor_t motors[] = {
         .calibration_current = 10.0f, // [A]
         .phase_inductance = 0.0f, // to be set by measure_phase_inductance
         .phase_resistance = 0.0f, // to be set by measure_phase_resistance
+        .phase_params_valid = false, // set by calibration or load_configuration
+        .dead_time_comp = TIM_1_8_DEADTIME_CLOCKS, // [clocks] nominal until measured by measure_phase_resistance
+        .dead_time_comp_band = 0.5f, // [A]
+        .discontinuous_pwm = false,
+        .fet_thermistor = {.temperature = 0.0f, .valid = false},
+        .fet_temp_derating = false, // enable on boards with FET thermistors fitted
+        .fet_temp_derate_start = 80.0f, // [degC]
+        .fet_temp_derate_stop = 100.0f, // [degC]
         .motor_thread = 0,
         .thread_ready = false,
         .enable_control = true,
@@ -71,6 +227,8 @@ Motor_t motors[] = {
         .last_cpu_time = 0,
         .current_meas = {0.0f, 0.0f},
         .DC_calib = {0.0f, 0.0f},
+        .DC_calib_stats = {{0}},
+        .DC_calib_converged = false,
         .gate_driver = {
             .spiHandle = &hspi3,
             // Note: this board has the EN_Gate pin shared!
@@ -87,22 +245,55 @@ Motor_t motors[] = {
         .current_control = {
             // .current_lim = 75.0f, //[A] // Note: consistent with 40v/v gain
             .current_lim = 10.0f, //[A]
+            .max_modulation = 0.80f, // leaves time for the current measurement, see Current_control_t
+            .overmodulation = false,
+            .bandwidth = 1000.0f, // [rad/s]
             .p_gain = 0.0f, // [V/A] should be auto set after resistance and inductance measurement
             .i_gain = 0.0f, // [V/As] should be auto set after resistance and inductance measurement
             .v_current_control_integral_d = 0.0f,
             .v_current_control_integral_q = 0.0f,
-            .Ibus = 0.0f
+            .Ibus = 0.0f,
+            .Iq_measured = 0.0f,
+            .final_v_alpha = 0.0f,
+            .final_v_beta = 0.0f
         },
+        .power = {0},
         .rotor = {
             .encoder_timer = &htim3,
+            .edge_timer = &htim5,
             .encoder_offset = 0,
             .encoder_state = 0,
             .motor_dir = 0, // set by calib_enc_offset
+            .use_index = false,
+            .index_search_active = false,
+            .index_found = false,
+            .index_offset_valid = false, // set by calibration or load_configuration
             .phase = 0.0f, // [rad]
             .pll_pos = 0.0f, // [rad]
             .pll_vel = 0.0f, // [rad/s]
             .pll_kp = 0.0f, // [rad/s / rad]
-            .pll_ki = 0.0f // [(rad/s^2) / rad]
+            .pll_ki = 0.0f, // [(rad/s^2) / rad]
+            .edge_timer_last = 0,
+            .edge_timer_now = 0,
+            .edge_time = 0,
+            .edge_count = 0,
+            .edge_valid = false,
+            .edge_vel = 0.0f // [counts/s]
+        },
+        .sensorless_mode = false,
+        .sensorless = {
+            .pm_flux_linkage = 5.51328895422f / (POLE_PAIRS * 280.0f), // [V / (rad/s)] 5.51328895422 / (pole pairs * motor kv)
+            .observer_gain = 1000.0f, // [rad/s]
+            .flux_state = {0.0f, 0.0f},
+            .v_alpha_beta_memory = {0.0f, 0.0f},
+            .phase = 0.0f,
+            .pll_pos = 0.0f,
+            .pll_vel = 0.0f,
+            .pll_kp = 2000.0f, // [rad/s / rad] 1000rad/s bandwidth
+            .pll_ki = 1000000.0f, // [(rad/s^2) / rad] critically damped
+            .spin_up_current = 10.0f, // [A]
+            .spin_up_acceleration = 400.0f, // [rad/s^2]
+            .spin_up_target_vel = 400.0f // [rad/s]
         },
         .timing_log_index = 0,
         .timing_log = {0}
@@ -111,7 +302,16 @@ Motor_t motors[] = {
         .control_mode = CTRL_MODE_POSITION_CONTROL, //see: Motor_control_mode_t
         .enable_step_dir = false, //auto enabled after calibration
         .counts_per_step = 2.0f,
+        .step_filter = {
+            .enabled = true,
+            .kp = 1000.0f, // [(counts/s) / count] 500rad/s bandwidth
+            .ki = 250000.0f, // [(counts/s^2) / count] critically damped
+            .input = 0.0f,
+            .error = 0.0f,
+            .vel = 0.0f,
+        },
         .error = ERROR_NO_ERROR,
+        .gate_driver_fault = 0,
         .pos_setpoint = 0.0f,
         .pos_gain = 20.0f, // [(counts/s) / counts]
         .vel_setpoint = 0.0f,
@@ -123,6 +323,14 @@ Motor_t motors[] = {
         .calibration_current = 10.0f, // [A]
         .phase_inductance = 0.0f, // to be set by measure_phase_inductance
         .phase_resistance = 0.0f, // to be set by measure_phase_resistance
+        .phase_params_valid = false, // set by calibration or load_configuration
+        .dead_time_comp = TIM_1_8_DEADTIME_CLOCKS, // [clocks] nominal until measured by measure_phase_resistance
+        .dead_time_comp_band = 0.5f, // [A]
+        .discontinuous_pwm = false,
+        .fet_thermistor = {.temperature = 0.0f, .valid = false},
+        .fet_temp_derating = false, // enable on boards with FET thermistors fitted
+        .fet_temp_derate_start = 80.0f, // [degC]
+        .fet_temp_derate_stop = 100.0f, // [degC]
         .motor_thread = 0,
         .thread_ready = false,
         .enable_control = true,
@@ -134,6 +342,8 @@ Motor_t motors[] = {
         .last_cpu_time = 0,
         .current_meas = {0.0f, 0.0f},
         .DC_calib = {0.0f, 0.0f},
+        .DC_calib_stats = {{0}},
+        .DC_calib_converged = false,
         .gate_driver = {
             .spiHandle = &hspi3,
             // Note: this board has the EN_Gate pin shared!
@@ -150,22 +360,55 @@ Motor_t motors[] = {
         .current_control = {
             // .current_lim = 75.0f, //[A] // Note: consistent with 40v/v gain
             .current_lim = 10.0f, //[A]
+            .max_modulation = 0.80f, // leaves time for the current measurement, see Current_control_t
+            .overmodulation = false,
+            .bandwidth = 1000.0f, // [rad/s]
             .p_gain = 0.0f, // [V/A] should be auto set after resistance and inductance measurement
             .i_gain = 0.0f, // [V/As] should be auto set after resistance and inductance measurement
             .v_current_control_integral_d = 0.0f,
             .v_current_control_integral_q = 0.0f,
-            .Ibus = 0.0f
+            .Ibus = 0.0f,
+            .Iq_measured = 0.0f,
+            .final_v_alpha = 0.0f,
+            .final_v_beta = 0.0f
         },
+        .power = {0},
         .rotor = {
             .encoder_timer = &htim4,
+            .edge_timer = &htim12,
             .encoder_offset = 0,
             .encoder_state = 0,
             .motor_dir = 0, // set by calib_enc_offset
+            .use_index = false,
+            .index_search_active = false,
+            .index_found = false,
+            .index_offset_valid = false, // set by calibration or load_configuration
             .phase = 0.0f,
             .pll_pos = 0.0f, // [rad]
             .pll_vel = 0.0f, // [rad/s]
             .pll_kp = 0.0f, // [rad/s / rad]
-            .pll_ki = 0.0f // [(rad/s^2) / rad]
+            .pll_ki = 0.0f, // [(rad/s^2) / rad]
+            .edge_timer_last = 0,
+            .edge_timer_now = 0,
+            .edge_time = 0,
+            .edge_count = 0,
+            .edge_valid = false,
+            .edge_vel = 0.0f // [counts/s]
+        },
+        .sensorless_mode = false,
+        .sensorless = {
+            .pm_flux_linkage = 5.51328895422f / (POLE_PAIRS * 280.0f), // [V / (rad/s)] 5.51328895422 / (pole pairs * motor kv)
+            .observer_gain = 1000.0f, // [rad/s]
+            .flux_state = {0.0f, 0.0f},
+            .v_alpha_beta_memory = {0.0f, 0.0f},
+            .phase = 0.0f,
+            .pll_pos = 0.0f,
+            .pll_vel = 0.0f,
+            .pll_kp = 2000.0f, // [rad/s / rad] 1000rad/s bandwidth
+            .pll_ki = 1000000.0f, // [(rad/s^2) / rad] critically damped
+            .spin_up_current = 10.0f, // [A]
+            .spin_up_acceleration = 400.0f, // [rad/s^2]
+            .spin_up_target_vel = 400.0f // [rad/s]
         },
         .timing_log_index = 0,
         .timing_log = {0}
@@ -178,134 +421,80 @@ static const float one_by_sqrt3 = 0.57735026919f;
 static const float sqrt3_by_2 = 0.86602540378f;
 
 /* Private variables ---------------------------------------------------------*/
-static float brake_resistance = 0.47f; // [ohm]
-
-/* Monitoring */
-monitoring_slot monitoring_slots[20] = {0};
-
-/* variables exposed to usb interface via set/get/monitor
- * If you change something here, don't forget to regenerate the python interface with generate_api.py
- * ro/rw : read only/read write -> ro prevents the code generator from generating setter
- * */
-
-float* exposed_floats[] = {
-    &vbus_voltage, // ro
-    &elec_rad_per_enc, // ro
-    &motors[0].pos_setpoint, // rw
-    &motors[0].pos_gain, // rw
-    &motors[0].vel_setpoint, // rw
-    &motors[0].vel_gain, // rw
-    &motors[0].vel_integrator_gain, // rw
-    &motors[0].vel_integrator_current, // rw
-    &motors[0].vel_limit, // rw
-    &motors[0].current_setpoint, // rw
-    &motors[0].calibration_current, // rw
-    &motors[0].phase_inductance, // ro
-    &motors[0].phase_resistance, // ro
-    &motors[0].current_meas.phB, // ro
-    &motors[0].current_meas.phC, // ro
-    &motors[0].DC_calib.phB, // rw
-    &motors[0].DC_calib.phC, // rw
-    &motors[0].shunt_conductance, // rw
-    &motors[0].phase_current_rev_gain, // rw
-    &motors[0].current_control.current_lim, // rw
-    &motors[0].current_control.p_gain, // rw
-    &motors[0].current_control.i_gain, // rw
-    &motors[0].current_control.v_current_control_integral_d, // rw
-    &motors[0].current_control.v_current_control_integral_q, // rw
-    &motors[0].current_control.Ibus, // ro
-    &motors[0].rotor.phase, // ro
-    &motors[0].rotor.pll_pos, // rw
-    &motors[0].rotor.pll_vel, // rw
-    &motors[0].rotor.pll_kp, // rw
-    &motors[0].rotor.pll_ki, // rw
-    &motors[1].pos_setpoint, // rw
-    &motors[1].pos_gain, // rw
-    &motors[1].vel_setpoint, // rw
-    &motors[1].vel_gain, // rw
-    &motors[1].vel_integrator_gain, // rw
-    &motors[1].vel_integrator_current, // rw
-    &motors[1].vel_limit, // rw
-    &motors[1].current_setpoint, // rw
-    &motors[1].calibration_current, // rw
-    &motors[1].phase_inductance, // ro
-    &motors[1].phase_resistance, // ro
-    &motors[1].current_meas.phB, // ro
-    &motors[1].current_meas.phC, // ro
-    &motors[1].DC_calib.phB, // rw
-    &motors[1].DC_calib.phC, // rw
-    &motors[1].shunt_conductance, // rw
-    &motors[1].phase_current_rev_gain, // rw
-    &motors[1].current_control.current_lim, // rw
-    &motors[1].current_control.p_gain, // rw
-    &motors[1].current_control.i_gain, // rw
-    &motors[1].current_control.v_current_control_integral_d, // rw
-    &motors[1].current_control.v_current_control_integral_q, // rw
-    &motors[1].current_control.Ibus, // ro
-    &motors[1].rotor.phase, // ro
-    &motors[1].rotor.pll_pos, // rw
-    &motors[1].rotor.pll_vel, // rw
-    &motors[1].rotor.pll_kp, // rw
-    &motors[1].rotor.pll_ki, // rw
-};
-
-int* exposed_ints[] = {
-    (int*)&motors[0].control_mode, // rw
-    &motors[0].rotor.encoder_offset, // rw
-    &motors[0].rotor.encoder_state, // ro
-    &motors[0].error, // rw
-    (int*)&motors[1].control_mode, // rw
-    &motors[1].rotor.encoder_offset, // rw
-    &motors[1].rotor.encoder_state, // ro
-    &motors[1].error, // rw
-};
-
-bool* exposed_bools[] = {
-    &motors[0].thread_ready, // ro
-    &motors[0].enable_control, // rw
-    &motors[0].do_calibration, // rw
-    &motors[0].calibration_ok, // ro
-    &motors[1].thread_ready, // ro
-    &motors[1].enable_control, // rw
-    &motors[1].do_calibration, // rw
-    &motors[1].calibration_ok, // ro
-};
-
-uint16_t* exposed_uint16[] = {
-    &motors[0].control_deadline, // rw
-    &motors[0].last_cpu_time, // ro
-    &motors[1].control_deadline, // rw
-    &motors[1].last_cpu_time, // ro
+// The ADC1 regular conversions cycle through these, see temp_sense_adc_cb
+static const struct {
+    uint32_t channel;
+    Thermistor_t* thermistor;
+} thermistor_channels[] = {
+    {ADC_CHANNEL_15, &motors[0].fet_thermistor}, // M0_TEMP
+    {ADC_CHANNEL_1, &motors[1].fet_thermistor}, // M1_TEMP
+    {ADC_CHANNEL_14, &aux_thermistor}, // AUX_TEMP
 };
+static const int num_thermistors = sizeof(thermistor_channels)/sizeof(thermistor_channels[0]);
+// PWM timing derived from pwm_frequency by set_pwm_frequency.
+// One up-down counting period of TIM1/TIM8 is one current measurement period of each motor.
+static uint16_t pwm_period_clocks = TIM_1_8_PERIOD_CLOCKS; // [clocks] TIM1/TIM8 auto-reload value
+static float current_meas_period = (float)(2 * TIM_1_8_PERIOD_CLOCKS) / (float)TIM_1_8_CLOCK_HZ; // [s]
+static int current_meas_hz = TIM_1_8_CLOCK_HZ / (2 * TIM_1_8_PERIOD_CLOCKS);
+static float calib_filter_k = ((float)(2 * TIM_1_8_PERIOD_CLOCKS) / (float)TIM_1_8_CLOCK_HZ) / DC_CALIB_FILTER_TAU;
+static float vbus_filter_k = (0.5f * (float)(2 * TIM_1_8_PERIOD_CLOCKS) / (float)TIM_1_8_CLOCK_HZ) / VBUS_FILTER_TAU;
+// Each thermistor is sampled once every num_thermistors current measurement periods
+static float thermistor_filter_k = ((float)(sizeof(thermistor_channels)/sizeof(thermistor_channels[0])) * (float)(2 * TIM_1_8_PERIOD_CLOCKS) / (float)TIM_1_8_CLOCK_HZ) / THERMISTOR_FILTER_TAU;
+static float power_filter_k = ((float)(2 * TIM_1_8_PERIOD_CLOCKS) / (float)TIM_1_8_CLOCK_HZ) / POWER_FILTER_TAU;
+// Conversion between voltage and modulation index, updated with every vbus reading
+// so the control loops don't have to divide. Initial values match vbus_voltage.
+static float vbus_V_to_mod = 1.0f / ((2.0f / 3.0f) * 12.0f); // [1/V]
+static float vbus_mod_to_V = (2.0f / 3.0f) * 12.0f; // [V]
+static bool gate_drivers_initialized = false;
 
 /* Private function prototypes -----------------------------------------------*/
-// Command Handling
-static void print_monitoring(int limit);
 // Utility
 static uint16_t check_timing(Motor_t* motor);
 static void global_fault(int error);
 static float phase_current_from_adcval(Motor_t* motor, uint32_t ADCValue);
+static bool any_motor_armed();
+static void update_DC_calib_stats(Motor_t* motor, float phB, float phC);
+static void update_thermistor(Thermistor_t* thermistor, uint32_t ADCValue);
+// Configuration persistence
+static void load_configuration();
 // Initalisation
+static void set_pwm_frequency(int frequency);
 static void DRV8301_setup(Motor_t* motor);
 static void start_adc_pwm();
 static void start_pwm(TIM_HandleTypeDef* htim);
+static void start_step_counter();
 static void sync_timers(TIM_HandleTypeDef* htim_a, TIM_HandleTypeDef* htim_b,
         uint16_t TIM_CLOCKSOURCE_ITRx, uint16_t count_offset);
 // IRQ Callbacks (are all public)
 // Measurement and calibrationa
+static bool measure_test_voltage(Motor_t* motor, float test_current, float max_voltage, float* test_voltage);
 static bool measure_phase_resistance(Motor_t* motor, float test_current, float max_voltage);
 static bool measure_phase_inductance(Motor_t* motor, float voltage_low, float voltage_high);
 static bool calib_enc_offset(Motor_t* motor, float voltage_magnitude);
+static bool index_search(Motor_t* motor, float voltage_magnitude);
 static bool motor_calibration(Motor_t* motor);
 // Test functions
 static void scan_motor_loop(Motor_t* motor, float omega, float voltage_magnitude);
 static void FOC_voltage_loop(Motor_t* motor, float v_d, float v_q);
 // Main motor control
+static void reset_encoder_edges(Rotor_t* rotor);
+static float interpolate_encoder_pos(Rotor_t* rotor);
 static void update_rotor(Rotor_t* rotor);
+static void update_sensorless(Motor_t* motor);
+static bool spin_up_sensorless(Motor_t* motor);
 static void update_brake_current(float brake_current);
+static void update_brake();
+static void check_gate_driver_fault();
+static void fold_step_count();
+static int take_counted_steps();
+static void reset_step_input(Motor_t* motor);
+static void update_step_input(Motor_t* motor, float counts);
+static void update_pwm_sync();
+static int decode_gate_driver_status(const DRV_SPI_8301_Vars_t* regs);
 static void queue_modulation_timings(Motor_t* motor, float mod_alpha, float mod_beta);
 static void queue_voltage_timings(Motor_t* motor, float v_alpha, float v_beta);
-static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des);
+static void update_power_meter(Motor_t* motor, float Id, float Iq);
+static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des, float phase);
 static void control_motor_loop(Motor_t* motor);
 // Motor thread (is public)
 
@@ -313,32 +502,9 @@ static void control_motor_loop(Motor_t* motor);
 /* Function implementations --------------------------------------------------*/
 
 //--------------------------------
-// Command Handling
-// TODO move to different file
+// Setpoints
 //--------------------------------
 
-static void print_monitoring(int limit) {
-    for (int i=0;i<limit;i++) {
-        switch (monitoring_slots[i].type) {
-        case 0:
-            printf("%f\t",*exposed_floats[monitoring_slots[i].index]);
-            break;
-        case 1:
-            printf("%d\t",*exposed_ints[monitoring_slots[i].index]);
-            break;
-        case 2:
-            printf("%d\t",*exposed_bools[monitoring_slots[i].index]);
-            break;
-        case 3:
-            printf("%hu\t",*exposed_uint16[monitoring_slots[i].index]);
-            break;
-        default:
-            i=100;
-        }
-    }
-    printf("\n");
-}
-
 void set_pos_setpoint(Motor_t* motor, float pos_setpoint, float vel_feed_forward, float current_feed_forward) {
     motor->pos_setpoint = pos_setpoint;
     motor->vel_setpoint = vel_feed_forward;
@@ -366,109 +532,6 @@ void set_current_setpoint(Motor_t* motor, float current_setpoint) {
 #endif
 }
 
-void motor_parse_cmd(uint8_t* buffer, int len) {
-
-    // TODO very hacky way of terminating sscanf at end of buffer:
-    // We should do some proper struct packing instead of using sscanf altogether
-    buffer[len] = 0;
-
-    // check incoming packet type
-    if (buffer[0] == 'p') {
-        // position control
-        unsigned motor_number;
-        float pos_setpoint, vel_feed_forward, current_feed_forward;
-        int numscan = sscanf((const char*)buffer, "p %u %f %f %f", &motor_number, &pos_setpoint, &vel_feed_forward, &current_feed_forward);
-        if (numscan == 4 && motor_number < num_motors) {
-            set_pos_setpoint(&motors[motor_number], pos_setpoint, vel_feed_forward, current_feed_forward);
-        }
-    } else if (buffer[0] == 'v') {
-        // velocity control
-        unsigned motor_number;
-        float vel_feed_forward, current_feed_forward;
-        int numscan = sscanf((const char*)buffer, "v %u %f %f", &motor_number, &vel_feed_forward, &current_feed_forward);
-        if (numscan == 3 && motor_number < num_motors) {
-            set_vel_setpoint(&motors[motor_number], vel_feed_forward, current_feed_forward);
-        }
-    } else if (buffer[0] == 'c') {
-        // current control
-        unsigned motor_number;
-        float current_feed_forward;
-        int numscan = sscanf((const char*)buffer, "c %u %f", &motor_number, &current_feed_forward);
-        if (numscan == 2 && motor_number < num_motors) {
-            set_current_setpoint(&motors[motor_number], current_feed_forward);
-        }
-    } else if (buffer[0] == 'g') { // GET
-        // g <0:float,1:int,2:bool,3:uint16> index
-        int type = 0;
-        int index = 0;
-        int numscan = sscanf((const char*)buffer, "g %u %u", &type, &index);
-        if (numscan == 2) {
-            switch(type){
-            case 0: {
-                printf("%f\n",*exposed_floats[index]);
-                break;
-            };
-            case 1: {
-                printf("%d\n",*exposed_ints[index]);
-                break;
-            };
-            case 2: {
-                printf("%d\n",*exposed_bools[index]);
-                break;
-            };
-            case 3: {
-                printf("%hu\n",*exposed_uint16[index]);
-                break;
-            };
-            }
-        }
-    } else if (buffer[0] == 's') { // SET
-        // s <0:float,1:int,2:bool,3:uint16> index value
-        int type = 0;
-        int index = 0;
-        int numscan = sscanf((const char*)buffer, "s %u %u", &type, &index);
-        if (numscan == 2) {
-            switch(type) {
-            case 0: {
-                sscanf((const char*)buffer, "s %u %u %f", &type, &index, exposed_floats[index]);
-                break;
-            };
-            case 1: {
-                sscanf((const char*)buffer, "s %u %u %d", &type, &index, exposed_ints[index]);
-                break;
-            };
-            case 2: {
-                int btmp = 0;
-                sscanf((const char*)buffer, "s %u %u %d", &type, &index, &btmp);
-                *exposed_bools[index] = btmp ? true : false;
-                break;
-            };
-            case 3: {
-                sscanf((const char*)buffer, "s %u %u %hu", &type, &index, exposed_uint16[index]);
-                break;
-            };
-            }
-        }
-    } else if (buffer[0] == 'm') { // Setup Monitor
-        // m <0:float,1:int,2:bool,3:uint16> index monitoring_slot
-        int type = 0;
-        int index = 0;
-        int slot = 0;
-        int numscan = sscanf((const char*)buffer, "m %u %u %u", &type, &index, &slot);
-        if (numscan == 3) {
-            monitoring_slots[slot].type = type;
-            monitoring_slots[slot].index = index;
-        }
-    } else if (buffer[0] == 'o') { // Output Monitor
-        int limit = 0;
-        int numscan = sscanf((const char*)buffer, "o %u", &limit);
-        if (numscan == 1) {
-            print_monitoring(limit);
-        }
-    }
-}
-
-
 //--------------------------------
 // Utility
 //--------------------------------
@@ -478,8 +541,10 @@ static uint16_t check_timing(Motor_t* motor) {
     uint16_t timing = htim->Instance->CNT;
     bool down = htim->Instance->CR1 & TIM_CR1_DIR;
     if (down) {
-        uint16_t delta = TIM_1_8_PERIOD_CLOCKS - timing;
-        timing = TIM_1_8_PERIOD_CLOCKS + delta;
+        // The live ARR, the PWM_SYNC trim moves it away from pwm_period_clocks
+        uint16_t arr = htim->Instance->ARR;
+        uint16_t delta = arr - timing;
+        timing = arr + delta;
     }
 
     if(++(motor->timing_log_index) == TIMING_LOG_SIZE){
@@ -501,8 +566,7 @@ static void global_fault(int error){
         motors[i].enable_control = false;
         motors[i].calibration_ok = false;
     }
-    // disable brake resistor
-    update_brake_current(0.0f);
+    // The brake keeps running: a coasting motor still pumps energy into the bus through the body diodes
 }
 
 static float phase_current_from_adcval(Motor_t* motor, uint32_t ADCValue) {
@@ -513,6 +577,206 @@ static float phase_current_from_adcval(Motor_t* motor, uint32_t ADCValue) {
     return current;
 }
 
+static bool any_motor_armed() {
+    for (int i = 0; i < num_motors; ++i) {
+        if (motors[i].motor_timer->Instance->BDTR & TIM_BDTR_MOE)
+            return true;
+    }
+    return false;
+}
+
+// Startup DC_calib: accumulate statistics until the mean is accurate enough on both phases
+static void update_DC_calib_stats(Motor_t* motor, float phB, float phC) {
+    running_stats_update(&motor->DC_calib_stats[0], phB);
+    running_stats_update(&motor->DC_calib_stats[1], phC);
+
+    bool converged = true;
+    for (int i = 0; i < 2; ++i) {
+        Running_stats_t* stats = &motor->DC_calib_stats[i];
+        if (stats->n < DC_CALIB_MIN_SAMPLES ||
+                running_stats_var_of_mean(stats) > DC_CALIB_MAX_STDERR * DC_CALIB_MAX_STDERR)
+            converged = false;
+    }
+
+    if (converged) {
+        motor->DC_calib.phB = motor->DC_calib_stats[0].mean;
+        motor->DC_calib.phC = motor->DC_calib_stats[1].mean;
+        motor->DC_calib_converged = true;
+    } else if (motor->DC_calib_stats[1].n >= DC_CALIB_MAX_SAMPLES) {
+        running_stats_reset(&motor->DC_calib_stats[0]);
+        running_stats_reset(&motor->DC_calib_stats[1]);
+    }
+}
+
+// Converts an NTC divider reading to degC with the Beta equation and low pass filters it
+static void update_thermistor(Thermistor_t* thermistor, uint32_t ADCValue) {
+    float ratio = (float)ADCValue / (float)(1<<12);
+    if (ratio < THERMISTOR_MIN_RATIO || ratio > 1.0f - THERMISTOR_MIN_RATIO) {
+        thermistor->valid = false;
+        return;
+    }
+    float R = THERMISTOR_R_PULLUP * ratio / (1.0f - ratio);
+    float T = 1.0f / (1.0f / (25.0f + 273.15f) + logf(R / THERMISTOR_R25) / THERMISTOR_BETA) - 273.15f;
+    // Start the filter at the first valid reading, rather than ramping up from 0degC
+    if (thermistor->valid)
+        thermistor->temperature += (T - thermistor->temperature) * thermistor_filter_k;
+    else
+        thermistor->temperature = T;
+    thermistor->valid = true;
+}
+
+
+//--------------------------------
+// Configuration persistence
+//--------------------------------
+
+// Overwrites the defaults in motors[] with the configuration saved in flash, if there is one
+static void load_configuration() {
+    Config_t config;
+    if (!nvm_load(&config, sizeof(config), CONFIG_VERSION))
+        return;
+
+    pwm_frequency = config.pwm_frequency;
+    brake.resistance = config.brake_resistance;
+    brake.power_rating = config.brake_power_rating;
+    brake.thermal_time_constant = config.brake_thermal_time_constant;
+    brake.vbus_brake_start = config.vbus_brake_start;
+    brake.vbus_overvoltage_trip = config.vbus_overvoltage_trip;
+    brake.vbus_p_gain = config.vbus_p_gain;
+    brake.vbus_i_gain = config.vbus_i_gain;
+    can_node_id = config.can_node_id;
+    can_telemetry_period = config.can_telemetry_period;
+    can_sync = config.can_sync;
+    step_counter.enabled = config.step_counter_enabled;
+    // Mappings to variables that no longer exist are dropped
+    for (int i = 0; i < CAN_NUM_PDOS; ++i) {
+        Can_pdo_t* pdo = &config.can_pdos[i];
+        can_set_pdo(i, pdo->period, pdo->on_change, pdo->entries, pdo->num_entries);
+    }
+
+    for (int i = 0; i < num_motors; ++i) {
+        Motor_t* motor = &motors[i];
+        Motor_config_t* motor_config = &config.motors[i];
+
+        if (motor_config->phase_params_valid) {
+            motor->phase_resistance = motor_config->phase_resistance;
+            motor->phase_inductance = motor_config->phase_inductance;
+            motor->dead_time_comp = motor_config->dead_time_comp;
+            motor->current_control.p_gain = motor_config->current_p_gain;
+            motor->current_control.i_gain = motor_config->current_i_gain;
+            motor->rotor.pll_kp = motor_config->pll_kp;
+            motor->rotor.pll_ki = motor_config->pll_ki;
+            motor->phase_params_valid = true;
+        }
+        // Note: With an incremental encoder the offset is lost on power down,
+        // so it can only be reused if it is relative to the index pulse.
+        // Otherwise calib_enc_offset still runs and overwrites these.
+        motor->rotor.encoder_offset = motor_config->encoder_offset;
+        motor->rotor.motor_dir = motor_config->motor_dir;
+        motor->rotor.use_index = motor_config->use_index;
+        motor->rotor.index_offset_valid = motor_config->use_index && motor_config->index_offset_valid;
+
+        motor->control_mode = (Motor_control_mode_t)motor_config->control_mode;
+        motor->counts_per_step = motor_config->counts_per_step;
+        motor->step_filter.enabled = motor_config->step_filter_enabled;
+        motor->step_filter.kp = motor_config->step_filter_kp;
+        motor->step_filter.ki = motor_config->step_filter_ki;
+        motor->pos_gain = motor_config->pos_gain;
+        motor->vel_gain = motor_config->vel_gain;
+        motor->vel_integrator_gain = motor_config->vel_integrator_gain;
+        motor->vel_limit = motor_config->vel_limit;
+        motor->calibration_current = motor_config->calibration_current;
+        motor->current_control.current_lim = motor_config->current_lim;
+        motor->current_control.bandwidth = motor_config->current_control_bandwidth;
+        motor->current_control.max_modulation = motor_config->max_modulation;
+        motor->current_control.overmodulation = motor_config->overmodulation;
+        motor->dead_time_comp_band = motor_config->dead_time_comp_band;
+        motor->discontinuous_pwm = motor_config->discontinuous_pwm;
+        motor->fet_temp_derating = motor_config->fet_temp_derating;
+        motor->fet_temp_derate_start = motor_config->fet_temp_derate_start;
+        motor->fet_temp_derate_stop = motor_config->fet_temp_derate_stop;
+        motor->sensorless_mode = motor_config->sensorless_mode;
+        motor->sensorless.pm_flux_linkage = motor_config->pm_flux_linkage;
+        motor->sensorless.observer_gain = motor_config->observer_gain;
+        motor->sensorless.spin_up_current = motor_config->spin_up_current;
+        motor->sensorless.spin_up_acceleration = motor_config->spin_up_acceleration;
+        motor->sensorless.spin_up_target_vel = motor_config->spin_up_target_vel;
+    }
+}
+
+bool save_configuration() {
+    // Programming and erasing flash stalls the CPU, and with it the current control interrupts
+    if (any_motor_armed())
+        return false;
+
+    Config_t config;
+    memset(&config, 0, sizeof(config));
+    config.pwm_frequency = pwm_frequency;
+    config.brake_resistance = brake.resistance;
+    config.brake_power_rating = brake.power_rating;
+    config.brake_thermal_time_constant = brake.thermal_time_constant;
+    config.vbus_brake_start = brake.vbus_brake_start;
+    config.vbus_overvoltage_trip = brake.vbus_overvoltage_trip;
+    config.vbus_p_gain = brake.vbus_p_gain;
+    config.vbus_i_gain = brake.vbus_i_gain;
+    config.can_node_id = can_node_id;
+    config.can_telemetry_period = can_telemetry_period;
+    config.can_sync = can_sync;
+    config.step_counter_enabled = step_counter.enabled;
+    memcpy(config.can_pdos, can_pdos, sizeof(config.can_pdos));
+    for (int i = 0; i < num_motors; ++i) {
+        Motor_t* motor = &motors[i];
+        Motor_config_t* motor_config = &config.motors[i];
+
+        motor_config->phase_params_valid = motor->phase_params_valid;
+        motor_config->phase_resistance = motor->phase_resistance;
+        motor_config->phase_inductance = motor->phase_inductance;
+        motor_config->dead_time_comp = motor->dead_time_comp;
+        motor_config->current_p_gain = motor->current_control.p_gain;
+        motor_config->current_i_gain = motor->current_control.i_gain;
+        motor_config->pll_kp = motor->rotor.pll_kp;
+        motor_config->pll_ki = motor->rotor.pll_ki;
+        motor_config->encoder_offset = motor->rotor.encoder_offset;
+        motor_config->motor_dir = motor->rotor.motor_dir;
+        motor_config->index_offset_valid = motor->rotor.index_offset_valid;
+
+        motor_config->control_mode = motor->control_mode;
+        motor_config->counts_per_step = motor->counts_per_step;
+        motor_config->step_filter_enabled = motor->step_filter.enabled;
+        motor_config->step_filter_kp = motor->step_filter.kp;
+        motor_config->step_filter_ki = motor->step_filter.ki;
+        motor_config->pos_gain = motor->pos_gain;
+        motor_config->vel_gain = motor->vel_gain;
+        motor_config->vel_integrator_gain = motor->vel_integrator_gain;
+        motor_config->vel_limit = motor->vel_limit;
+        motor_config->calibration_current = motor->calibration_current;
+        motor_config->current_lim = motor->current_control.current_lim;
+        motor_config->current_control_bandwidth = motor->current_control.bandwidth;
+        motor_config->max_modulation = motor->current_control.max_modulation;
+        motor_config->overmodulation = motor->current_control.overmodulation;
+        motor_config->dead_time_comp_band = motor->dead_time_comp_band;
+        motor_config->discontinuous_pwm = motor->discontinuous_pwm;
+        motor_config->fet_temp_derating = motor->fet_temp_derating;
+        motor_config->fet_temp_derate_start = motor->fet_temp_derate_start;
+        motor_config->fet_temp_derate_stop = motor->fet_temp_derate_stop;
+        motor_config->sensorless_mode = motor->sensorless_mode;
+        motor_config->pm_flux_linkage = motor->sensorless.pm_flux_linkage;
+        motor_config->observer_gain = motor->sensorless.observer_gain;
+        motor_config->spin_up_current = motor->sensorless.spin_up_current;
+        motor_config->spin_up_acceleration = motor->sensorless.spin_up_acceleration;
+        motor_config->spin_up_target_vel = motor->sensorless.spin_up_target_vel;
+        motor_config->use_index = motor->rotor.use_index;
+    }
+    return nvm_save(&config, sizeof(config), CONFIG_VERSION);
+}
+
+// Reverts to the compiled in defaults on the next boot
+bool erase_configuration() {
+    if (any_motor_armed())
+        return false;
+    return nvm_erase();
+}
+
 
 //--------------------------------
 // Initalisation
@@ -520,20 +784,78 @@ static float phase_current_from_adcval(Motor_t* motor, uint32_t ADCValue) {
 
 // Initalises the low level motor control and then starts the motor control threads
 void init_motor_control() {
+    load_configuration();
+    set_pwm_frequency(pwm_frequency);
+
     // Init gate drivers
     DRV8301_setup(&motors[0]);
     DRV8301_setup(&motors[1]);
+    gate_drivers_initialized = true;
 
     // Start PWM and enable adc interrupts/callbacks
     start_adc_pwm();
 
+    start_step_counter();
+
     // Start Encoders
     HAL_TIM_Encoder_Start(&htim3, TIM_CHANNEL_ALL);
     HAL_TIM_Encoder_Start(&htim4, TIM_CHANNEL_ALL);
+    HAL_TIM_IC_Start(&htim5, TIM_CHANNEL_1);
+    HAL_TIM_IC_Start(&htim12, TIM_CHANNEL_1);
 
     // Wait for current sense calibration to converge
-    // TODO make timing a function of calibration filter tau
-    osDelay(1500);
+    uint32_t wait_start = HAL_GetTick();
+    for (;;) {
+        bool all_converged = true;
+        for (int i = 0; i < num_motors; ++i)
+            all_converged &= motors[i].DC_calib_converged;
+        if (all_converged)
+            break;
+        if (HAL_GetTick() - wait_start > DC_CALIB_TIMEOUT) {
+            // Calibration of these motors will fail until DC_calib converges
+            for (int i = 0; i < num_motors; ++i) {
+                if (!motors[i].DC_calib_converged)
+                    motors[i].error = ERROR_DC_CAL_TIMEOUT;
+            }
+            break;
+        }
+        osDelay(1);
+    }
+
+    boot_to_ready_time = HAL_GetTick();
+}
+
+// Sets the TIM1/TIM8 period and everything derived from it.
+// Only call before the timers are started.
+static void set_pwm_frequency(int frequency) {
+    // check_timing counts up to 2x the period in 16 bits, and the control loops need time to run
+    if (frequency < PWM_FREQUENCY_MIN) frequency = PWM_FREQUENCY_MIN;
+    if (frequency > PWM_FREQUENCY_MAX) frequency = PWM_FREQUENCY_MAX;
+
+    pwm_period_clocks = TIM_1_8_CLOCK_HZ / (2 * frequency);
+    current_meas_period = (float)(2 * pwm_period_clocks) / (float)TIM_1_8_CLOCK_HZ;
+    current_meas_hz = TIM_1_8_CLOCK_HZ / (2 * pwm_period_clocks);
+    pwm_frequency = current_meas_hz; // report the frequency we actually got
+
+    calib_filter_k = current_meas_period / DC_CALIB_FILTER_TAU;
+    // vbus is sampled with every M0 current measurement, i.e. twice per period
+    vbus_filter_k = (0.5f * current_meas_period) / VBUS_FILTER_TAU;
+    // Each thermistor is sampled once every num_thermistors periods
+    thermistor_filter_k = (num_thermistors * current_meas_period) / THERMISTOR_FILTER_TAU;
+    power_filter_k = current_meas_period / POWER_FILTER_TAU;
+
+    // M1 is half a period behind M0, see start_adc_pwm
+    motors[0].control_deadline = pwm_period_clocks;
+    motors[1].control_deadline = (3 * pwm_period_clocks) / 2;
+    for (int i = 0; i < num_motors; ++i) {
+        for (int ph = 0; ph < 3; ++ph)
+            motors[i].next_timings[ph] = pwm_period_clocks / 2;
+        TIM_HandleTypeDef* htim = motors[i].motor_timer;
+        htim->Init.Period = pwm_period_clocks;
+        htim->Instance->ARR = pwm_period_clocks;
+        // Load the new period right away, the ADCs are not enabled yet so the update trigger is ignored
+        htim->Instance->EGR = TIM_EGR_UG;
+    }
 }
 
 // Set up the gate drivers
@@ -574,17 +896,28 @@ static void DRV8301_setup(Motor_t* motor) {
 }
 
 static void start_adc_pwm(){
+    // The ADC1 regular conversions, which the M1 current measurements trigger,
+    // sample the thermistors instead of vbus. Their source impedance needs a longer
+    // sample time. Configured in reverse, so the first thermistor is selected at the end.
+    for (int i = num_thermistors - 1; i >= 0; --i) {
+        ADC_ChannelConfTypeDef sConfig = {
+            .Channel = thermistor_channels[i].channel,
+            .Rank = 1,
+            .SamplingTime = ADC_SAMPLETIME_15CYCLES
+        };
+        HAL_ADC_ConfigChannel(&hadc1, &sConfig);
+    }
+
     // Enable ADC and interrupts
     __HAL_ADC_ENABLE(&hadc1);
     __HAL_ADC_ENABLE(&hadc2);
     __HAL_ADC_ENABLE(&hadc3);
     // Warp field stabilize.
     osDelay(2);
+    // ADC2 and ADC3 convert simultaneously with ADC1 (triple mode),
+    // so only the master raises interrupts.
     __HAL_ADC_ENABLE_IT(&hadc1, ADC_IT_JEOC);
-    __HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_JEOC);
-    __HAL_ADC_ENABLE_IT(&hadc3, ADC_IT_JEOC);
-    __HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_EOC);
-    __HAL_ADC_ENABLE_IT(&hadc3, ADC_IT_EOC);
+    __HAL_ADC_ENABLE_IT(&hadc1, ADC_IT_EOC);
 
     // Ensure that debug halting of the core doesn't leave the motor PWM running
     __HAL_DBGMCU_FREEZE_TIM1();
@@ -593,7 +926,7 @@ static void start_adc_pwm(){
     start_pwm(&htim1);
     start_pwm(&htim8);
     // TODO: explain why this offset
-    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, TIM_1_8_PERIOD_CLOCKS/2 - 1*128);
+    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, pwm_period_clocks/2 - 1*128);
 
     // Motor output starts in the disabled state
     __HAL_TIM_MOE_DISABLE_UNCONDITIONALLY(&htim1);
@@ -608,7 +941,7 @@ static void start_adc_pwm(){
 
 static void start_pwm(TIM_HandleTypeDef* htim){
     // Init PWM
-    int half_load = TIM_1_8_PERIOD_CLOCKS/2;
+    int half_load = pwm_period_clocks/2;
     htim->Instance->CCR1 = half_load;
     htim->Instance->CCR2 = half_load;
     htim->Instance->CCR3 = half_load;
@@ -672,6 +1005,25 @@ static void sync_timers(TIM_HandleTypeDef* htim_a, TIM_HandleTypeDef* htim_b,
     htim_b->Instance->BDTR |= MOE_store_b;
 }
 
+static void start_step_counter() {
+    if (!step_counter.enabled)
+        return;
+    Step_Counter_Timer_Init();
+
+    // GPIO_3 becomes the M1 direction input, interrupting on both edges
+    GPIO_InitTypeDef GPIO_InitStruct;
+    GPIO_InitStruct.Pin = GPIO_3_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+    GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+    HAL_GPIO_Init(GPIO_3_GPIO_Port, &GPIO_InitStruct);
+
+    step_counter.dir = HAL_GPIO_ReadPin(GPIO_3_GPIO_Port, GPIO_3_Pin) == GPIO_PIN_SET;
+    step_counter.timer_count = htim9.Instance->CNT;
+    step_counter.steps = 0;
+    HAL_TIM_Base_Start(&htim9);
+    step_counter.active = true;
+}
+
 
 //--------------------------------
 // IRQ Callbacks
@@ -687,15 +1039,19 @@ void step_cb(uint16_t GPIO_Pin) {
         if (motors[0].enable_step_dir) {
             dir_pin = HAL_GPIO_ReadPin(GPIO_2_GPIO_Port, GPIO_2_Pin);
             dir = (dir_pin == GPIO_PIN_SET) ? 1.0f : -1.0f;
-            motors[0].pos_setpoint += dir * motors[0].counts_per_step;
+            motors[0].step_filter.input += dir * motors[0].counts_per_step;
         }
         break;
     case GPIO_3_Pin:
-        //M1 stepped
-        if (motors[1].enable_step_dir) {
+        if (step_counter.active) {
+            // M1 direction changed, the steps counted so far went the old way
+            fold_step_count();
+            step_counter.dir = HAL_GPIO_ReadPin(GPIO_3_GPIO_Port, GPIO_3_Pin) == GPIO_PIN_SET;
+        } else if (motors[1].enable_step_dir) {
+            //M1 stepped
             dir_pin = HAL_GPIO_ReadPin(GPIO_4_GPIO_Port, GPIO_4_Pin);
             dir = (dir_pin == GPIO_PIN_SET) ? 1.0f : -1.0f;
-            motors[1].pos_setpoint += dir * motors[1].counts_per_step;
+            motors[1].step_filter.input += dir * motors[1].counts_per_step;
         }
         break;
     default:
@@ -704,27 +1060,128 @@ void step_cb(uint16_t GPIO_Pin) {
     }
 }
 
+// Adds the steps TIM9 counted since the last call to step_counter.steps, in the direction
+// the input had since its last edge. Steps that arrive before the direction interrupt has
+// run count the old way, so the direction must be set up a few us before the next step.
+// Runs from the direction interrupt, elsewhere call it with interrupts disabled.
+static void fold_step_count() {
+    uint16_t count = htim9.Instance->CNT;
+    int delta = (uint16_t)(count - step_counter.timer_count);
+    step_counter.timer_count = count;
+    step_counter.steps += step_counter.dir ? delta : -delta;
+}
+
+// Returns the signed steps counted since the last call, once per control cycle.
+// At 10MHz step rate and 8kHz control that is about 1250, well within the 16 bit counter.
+static int take_counted_steps() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    fold_step_count();
+    int steps = step_counter.steps;
+    step_counter.steps = 0;
+    __set_PRIMASK(primask);
+    return steps;
+}
+
+// encoder index pulse
+void enc_index_cb(uint16_t GPIO_Pin) {
+    Rotor_t* rotor;
+    switch (GPIO_Pin) {
+    case M0_ENC_Z_Pin:
+        rotor = &motors[0].rotor;
+        break;
+    case M1_ENC_Z_Pin:
+        rotor = &motors[1].rotor;
+        break;
+    default:
+        return;
+    }
+    // Only latch on the first pulse of a search, the motor thread takes it from there
+    if (rotor->index_search_active) {
+        rotor->encoder_timer->Instance->CNT = 0;
+        rotor->index_found = true;
+        rotor->index_search_active = false;
+    }
+}
+
 void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     static const float voltage_scale = 3.3f * 11.0f / (float)(1<<12);
+    // Below this, there is no meaningful bus voltage to modulate against
+    #define vbus_min_mod_voltage 1.0f
+
     // Only one conversion in sequence, so only rank1
-    uint32_t ADCValue = HAL_ADCEx_InjectedGetValue(hadc, ADC_INJECTED_RANK_1);
-    vbus_voltage = ADCValue * voltage_scale;
+    uint32_t ADCValue = injected ? hadc->Instance->JDR1 : hadc->Instance->DR;
+    vbus_voltage_raw = ADCValue * voltage_scale;
+    vbus_voltage += (vbus_voltage_raw - vbus_voltage) * vbus_filter_k;
+
+    float mod_voltage = vbus_voltage + vbus_ripple_ff_gain * (vbus_voltage_raw - vbus_voltage);
+    if (mod_voltage < vbus_min_mod_voltage) mod_voltage = vbus_min_mod_voltage;
+    vbus_mod_to_V = (2.0f / 3.0f) * mod_voltage;
+    vbus_V_to_mod = 1.0f / vbus_mod_to_V;
+}
+
+void temp_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
+    static int index = 0;
+    if (injected)
+        return;
+
+    update_thermistor(thermistor_channels[index].thermistor, hadc->Instance->DR);
+    // Select the next thermistor, the next regular trigger is a period away
+    if (++index >= num_thermistors)
+        index = 0;
+    hadc->Instance->SQR3 = thermistor_channels[index].channel;
+}
+
+// Called on every CAN SYNC frame, from an interrupt above the ADC priority so the arrival
+// time is read right away. All boards receive the same frame at the same time, so locking
+// each PWM to it also locks the boards to each other. The target is the TIM1 top (the M0
+// DC_CAL sample), half a period away from the M0 current measurement and its control loop.
+// The SYNC period should be a whole number of PWM periods, the integral only takes up
+// the crystal tolerance.
+void pwm_sync_cb() {
+    TIM_TypeDef* tim = motors[0].motor_timer->Instance;
+    int count = tim->CNT;
+    bool counting_down = tim->CR1 & TIM_CR1_DIR;
+    int arr = tim->ARR; // the top of the current period, including the trim
+    int phase = counting_down ? 2 * arr - count : count; // [clocks] since the TIM1 bottom
+    int error = phase - arr;
+
+    pwm_sync.phase_error = error;
+    pwm_sync.locked = abs(error) <= PWM_SYNC_LOCK_CLOCKS;
+    // While the last correction is still being slewed in, the error is mostly that,
+    // and integrating it would wind up the frequency trim.
+    int pending = (int32_t)(pwm_sync.correction - pwm_sync.applied);
+    if (abs(pending) <= 1) {
+        pwm_sync.integral += PWM_SYNC_I_GAIN * error;
+        if (pwm_sync.integral > pwm_period_clocks) pwm_sync.integral = pwm_period_clocks;
+        if (pwm_sync.integral < -pwm_period_clocks) pwm_sync.integral = -pwm_period_clocks;
+    }
+    // A late SYNC means our periods are too short, so the correction lengthens them.
+    // The error already includes everything applied so far, the rest of an older correction is dropped.
+    float correction = PWM_SYNC_P_GAIN * error + pwm_sync.integral + pwm_sync.residual;
+    int correction_clocks = (int)correction;
+    pwm_sync.residual = correction - correction_clocks;
+    pwm_sync.correction = pwm_sync.applied + correction_clocks;
 }
 
 // This is the callback from the ADC that we expect after the PWM has triggered an ADC conversion.
 // TODO: Document how the phasing is done, link to timing diagram
 void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
-    #define calib_tau 0.2f //@TOTO make more easily configurable
-    static const float calib_filter_k = CURRENT_MEAS_PERIOD / calib_tau;
-
-    // Ensure ADCs are expected ones to simplify the logic below
-    if (!(hadc == &hadc2 || hadc == &hadc3)){
+    // ADC1 is the triple mode master, the only one that raises interrupts
+    if (hadc != &hadc1) {
         global_fault(ERROR_ADC_FAILED);
         return;
     };
 
-    // Motor 0 is on Timer 1, which triggers ADC 2 and 3 on an injected conversion
-    // Motor 1 is on Timer 8, which triggers ADC 2 and 3 on a regular conversion
+    // ADC1 measures vbus alongside the M0 current measurements,
+    // and one of the thermistors alongside the M1 current measurements.
+    if (injected)
+        vbus_sense_adc_cb(hadc, injected);
+    else
+        temp_sense_adc_cb(hadc, injected);
+
+    // Motor 0 is on Timer 1, which triggers ADC 1, 2 and 3 simultaneously on an injected conversion
+    // Motor 1 is on Timer 8, which triggers ADC 1, 2 and 3 simultaneously on a regular conversion
     // If the corresponding timer is counting up, we just sampled in SVM vector 0, i.e. real current
     // If we are counting down, we just sampled in SVM vector 7, with zero current
     Motor_t* motor = injected ? &motors[0] : &motors[1];
@@ -734,24 +1191,20 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     if (motor == &motors[1] && counting_down) {
         // We are measuring M1 DC_CAL here
         current_meas_not_DC_CAL = false;
-        // Load next timings for M0 (only once is sufficient)
-        if (hadc == &hadc2) {
-            motors[0].motor_timer->Instance->CCR1 = motors[0].next_timings[0];
-            motors[0].motor_timer->Instance->CCR2 = motors[0].next_timings[1];
-            motors[0].motor_timer->Instance->CCR3 = motors[0].next_timings[2];
-        }
+        // Load next timings for M0
+        motors[0].motor_timer->Instance->CCR1 = motors[0].next_timings[0];
+        motors[0].motor_timer->Instance->CCR2 = motors[0].next_timings[1];
+        motors[0].motor_timer->Instance->CCR3 = motors[0].next_timings[2];
         // Check the timing of the sequencing
         check_timing(motor);
 
     } else if (motor == &motors[0] && !counting_down) {
         // We are measuring M0 current here
         current_meas_not_DC_CAL = true;
-        // Load next timings for M1 (only once is sufficient)
-        if (hadc == &hadc2) {
-            motors[1].motor_timer->Instance->CCR1 = motors[1].next_timings[0];
-            motors[1].motor_timer->Instance->CCR2 = motors[1].next_timings[1];
-            motors[1].motor_timer->Instance->CCR3 = motors[1].next_timings[2];
-        }
+        // Load next timings for M1
+        motors[1].motor_timer->Instance->CCR1 = motors[1].next_timings[0];
+        motors[1].motor_timer->Instance->CCR2 = motors[1].next_timings[1];
+        motors[1].motor_timer->Instance->CCR3 = motors[1].next_timings[2];
         // Check the timing of the sequencing
         check_timing(motor);
 
@@ -764,45 +1217,53 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     } else if (motor == &motors[0] && counting_down) {
         // We are measuring M0 DC_CAL here
         current_meas_not_DC_CAL = false;
+        // Right after the TIM1 top, well before the TIM8 top
+        update_pwm_sync();
         // Check the timing of the sequencing
         check_timing(motor);
+        // Once per period, with a fresh vbus reading
+        update_brake();
+        check_gate_driver_fault();
 
     } else {
         global_fault(ERROR_PWM_SRC_FAIL);
         return;
     }
 
-    uint32_t ADCValue;
+    // ADC2 and ADC3 record the phB and phC currents concurrently with ADC1,
+    // so their results are ready by the time ADC1 signals end of conversion.
+    // Reading the regular data registers also clears their EOC flags.
+    uint32_t ADCValue_phB, ADCValue_phC;
     if (injected) {
-        ADCValue = HAL_ADCEx_InjectedGetValue(hadc, ADC_INJECTED_RANK_1);
+        ADCValue_phB = hadc2.Instance->JDR1;
+        ADCValue_phC = hadc3.Instance->JDR1;
     } else {
-        ADCValue = HAL_ADC_GetValue(hadc);
+        ADCValue_phB = hadc2.Instance->DR;
+        ADCValue_phC = hadc3.Instance->DR;
     }
-    float current = phase_current_from_adcval(motor, ADCValue);
+    float current_phB = phase_current_from_adcval(motor, ADCValue_phB);
+    float current_phC = phase_current_from_adcval(motor, ADCValue_phC);
 
     if (current_meas_not_DC_CAL) {
-        // ADC2 and ADC3 record the phB and phC currents concurrently,
-        // and their interrupts should arrive on the same clock cycle.
-        // We dispatch the callbacks in order, so ADC2 will always be processed before ADC3.
-        // Therefore we store the value from ADC2 and signal the thread that the
-        // measurement is ready when we recieve the ADC3 measurement
-
-        // return or continue
-        if (hadc == &hadc2) {
-            motor->current_meas.phB = current - motor->DC_calib.phB;
-            return;
-        } else {
-            motor->current_meas.phC = current - motor->DC_calib.phC;
-        }
+        motor->current_meas.phB = current_phB - motor->DC_calib.phB;
+        motor->current_meas.phC = current_phC - motor->DC_calib.phC;
         // Trigger motor thread
         if (motor->thread_ready)
             osSignalSet(motor->motor_thread, M_SIGNAL_PH_CURRENT_MEAS);
     } else {
         // DC_CAL measurement
-        if (hadc == &hadc2) {
-            motor->DC_calib.phB += (current - motor->DC_calib.phB) * calib_filter_k;
+        if (!motor->DC_calib_converged) {
+            update_DC_calib_stats(motor, current_phB, current_phC);
         } else {
-            motor->DC_calib.phC += (current - motor->DC_calib.phC) * calib_filter_k;
+            // A phase clamped low by discontinuous PWM still carries current in this window,
+            // check both the applied timings and the ones about to be loaded.
+            TIM_TypeDef* tim = motor->motor_timer->Instance;
+            bool phB_clamped = tim->CCR2 == PWM_TIMING_NEVER_MATCHES || motor->next_timings[1] == PWM_TIMING_NEVER_MATCHES;
+            bool phC_clamped = tim->CCR3 == PWM_TIMING_NEVER_MATCHES || motor->next_timings[2] == PWM_TIMING_NEVER_MATCHES;
+            if (!phB_clamped)
+                motor->DC_calib.phB += (current_phB - motor->DC_calib.phB) * calib_filter_k;
+            if (!phC_clamped)
+                motor->DC_calib.phC += (current_phC - motor->DC_calib.phC) * calib_filter_k;
         }
     }
 }
@@ -813,10 +1274,11 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
 //--------------------------------
 
 // TODO check Ibeta balance to verify good motor connection
-static bool measure_phase_resistance(Motor_t* motor, float test_current, float max_voltage) {
+// Regulates the current along phase A to test_current, returns the voltage this took
+static bool measure_test_voltage(Motor_t* motor, float test_current, float max_voltage, float* test_voltage) {
     static const float kI = 10.0f; //[(V/s)/A]
-    static const int num_test_cycles = 3.0f / CURRENT_MEAS_PERIOD; // Test runs for 3s
-    float test_voltage = 0.0f;
+    const int num_test_cycles = 1.5f * current_meas_hz; // Test runs for 1.5s
+    float voltage = 0.0f;
     for (int i = 0; i < num_test_cycles; ++i) {
         osEvent evt = osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT);
         if (evt.status != osEventSignal){
@@ -824,12 +1286,12 @@ static bool measure_phase_resistance(Motor_t* motor, float test_current, float m
             return false;
         }
         float Ialpha = -0.5f * (motor->current_meas.phB + motor->current_meas.phC);
-        test_voltage += (kI * CURRENT_MEAS_PERIOD) * (test_current - Ialpha);
-        if (test_voltage > max_voltage) test_voltage = max_voltage;
-        if (test_voltage < -max_voltage) test_voltage = -max_voltage;
+        voltage += (kI * current_meas_period) * (test_current - Ialpha);
+        if (voltage > max_voltage) voltage = max_voltage;
+        if (voltage < -max_voltage) voltage = -max_voltage;
 
         // Test voltage along phase A
-        queue_voltage_timings(motor, test_voltage, 0.0f);
+        queue_voltage_timings(motor, voltage, 0.0f);
 
         // Check we meet deadlines after queueing
         motor->last_cpu_time = check_timing(motor);
@@ -842,19 +1304,47 @@ static bool measure_phase_resistance(Motor_t* motor, float test_current, float m
     // De-energize motor
     queue_voltage_timings(motor, 0.0f, 0.0f);
 
-    float R = test_voltage / test_current;
-    if (fabs(test_voltage) == fabs(max_voltage) || R < 0.01f || R > 1.0f) {
+    if (fabs(voltage) == fabs(max_voltage)) {
+        motor->error = ERROR_PHASE_RESISTANCE_OUT_OF_RANGE;
+        return false;
+    }
+    *test_voltage = voltage;
+    return true;
+}
+
+// Two point measurement with the dead time compensation off:
+// the slope is the resistance, the offset is the voltage lost to the dead time.
+static bool measure_phase_resistance(Motor_t* motor, float test_current, float max_voltage) {
+    float test_currents[2] = {0.5f * test_current, test_current};
+    float test_voltages[2];
+    motor->dead_time_comp = 0.0f;
+    for (int i = 0; i < 2; ++i) {
+        if (!measure_test_voltage(motor, test_currents[i], max_voltage, &test_voltages[i]))
+            return false;
+    }
+
+    float R = (test_voltages[1] - test_voltages[0]) / (test_currents[1] - test_currents[0]);
+    if (R < 0.01f || R > 1.0f) {
         motor->error = ERROR_PHASE_RESISTANCE_OUT_OF_RANGE;
         return false;
     }
     motor->phase_resistance = R;
+
+    // Current flows out of phase A and back through B and C, so A loses the dead time
+    // voltage while B and C gain it, which adds up to 4/3 of it along alpha.
+    float v_dead_time = 0.75f * (test_voltages[0] - R * test_currents[0]);
+    // The dead time is lost once per up-down counting period
+    float dead_time = v_dead_time / vbus_voltage * (float)(2 * pwm_period_clocks);
+    if (dead_time < 0.0f) dead_time = 0.0f;
+    if (dead_time > 4.0f * TIM_1_8_DEADTIME_CLOCKS) dead_time = 4.0f * TIM_1_8_DEADTIME_CLOCKS;
+    motor->dead_time_comp = dead_time;
     return true;
 }
 
 static bool measure_phase_inductance(Motor_t* motor, float voltage_low, float voltage_high) {
     float test_voltages[2] = {voltage_low, voltage_high};
     float Ialphas[2] = {0.0f};
-    static const int num_cycles = 5000;
+    const int num_cycles = 0.6f * current_meas_hz; // Test runs for 2x 0.6s
 
     for (int t = 0; t < num_cycles; ++t) {
         for (int i = 0; i < 2; ++i) {
@@ -882,7 +1372,7 @@ static bool measure_phase_inductance(Motor_t* motor, float voltage_low, float vo
     float v_L = 0.5f * (voltage_high - voltage_low);
     // Note: A more correct formula would also take into account that there is a finite timestep.
     // However, the discretisation in the current control loop inverts the same discrepancy
-    float dI_by_dt = (Ialphas[1] - Ialphas[0]) / (CURRENT_MEAS_PERIOD * (float)num_cycles);
+    float dI_by_dt = (Ialphas[1] - Ialphas[0]) / (current_meas_period * (float)num_cycles);
     float L = v_L / dI_by_dt;
     
     // TODO arbitrary values set for now
@@ -907,7 +1397,7 @@ static bool calib_enc_offset(Motor_t* motor, float voltage_magnitude) {
     int32_t encvaluesum = 0;
 
     // go to rotor zero phase for start_lock_duration to get ready to scan
-    for (int i = 0; i < start_lock_duration*CURRENT_MEAS_HZ; ++i) {
+    for (int i = 0; i < start_lock_duration*current_meas_hz; ++i) {
         if (osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal) {
             motor->error = ERROR_ENCODER_MEASUREMENT_TIMEOUT;
             return false;
@@ -916,7 +1406,7 @@ static bool calib_enc_offset(Motor_t* motor, float voltage_magnitude) {
     }
     // scan forwards
     for (float ph = -scan_range / 2.0f; ph < scan_range / 2.0f; ph += step_size) {
-        for (int i = 0; i < dt_step*(float)CURRENT_MEAS_HZ; ++i) {
+        for (int i = 0; i < dt_step*(float)current_meas_hz; ++i) {
             if (osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal) {
                 motor->error = ERROR_ENCODER_MEASUREMENT_TIMEOUT;
                 return false;
@@ -941,7 +1431,7 @@ static bool calib_enc_offset(Motor_t* motor, float voltage_magnitude) {
     }
     // scan backwards
     for (float ph = scan_range / 2.0f; ph > -scan_range / 2.0f; ph -= step_size) {
-        for (int i = 0; i < dt_step*(float)CURRENT_MEAS_HZ; ++i) {
+        for (int i = 0; i < dt_step*(float)current_meas_hz; ++i) {
             if (osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal) {
                 motor->error = ERROR_ENCODER_MEASUREMENT_TIMEOUT;
                 return false;
@@ -958,6 +1448,39 @@ static bool calib_enc_offset(Motor_t* motor, float voltage_magnitude) {
     return true;
 }
 
+// Slowly rotates the motor until the encoder index pulse zeroes the encoder count
+static bool index_search(Motor_t* motor, float voltage_magnitude) {
+    static const float omega = 4.0f * M_PI; // [rad/s] electrical
+    static const float max_revolutions = 1.5f; // mechanical
+    const int max_cycles = (max_revolutions * POLE_PAIRS * 2.0f * M_PI / omega) * current_meas_hz;
+
+    motor->rotor.index_found = false;
+    motor->rotor.index_search_active = true;
+    float ph = 0.0f;
+    for (int i = 0; i < max_cycles && !motor->rotor.index_found; ++i) {
+        if (osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal) {
+            motor->rotor.index_search_active = false;
+            motor->error = ERROR_ENCODER_MEASUREMENT_TIMEOUT;
+            return false;
+        }
+        float v_alpha = voltage_magnitude * arm_cos_f32(ph);
+        float v_beta  = voltage_magnitude * arm_sin_f32(ph);
+        queue_voltage_timings(motor, v_alpha, v_beta);
+        ph = fmodf(ph + omega * current_meas_period, 2.0f * M_PI);
+    }
+    motor->rotor.index_search_active = false;
+
+    if (!motor->rotor.index_found) {
+        motor->error = ERROR_INDEX_SEARCH_TIMEOUT;
+        return false;
+    }
+    // Encoder count was zeroed at the index
+    motor->rotor.encoder_state = 0;
+    motor->rotor.pll_pos = 0.0f;
+    reset_encoder_edges(&motor->rotor);
+    return true;
+}
+
 static bool motor_calibration(Motor_t* motor){
     motor->calibration_ok = false;
     motor->error = ERROR_NO_ERROR;
@@ -966,30 +1489,58 @@ static bool motor_calibration(Motor_t* motor){
     // float R = 0.0332548246f;
     // float L = 7.97315806e-06f;
 
-    if (!measure_phase_resistance(motor, motor->calibration_current, 1.0f))
-        return false;
-    if (!measure_phase_inductance(motor, -1.0f, 1.0f))
+    if (!motor->DC_calib_converged) {
+        motor->error = ERROR_DC_CAL_TIMEOUT;
         return false;
-    if (!calib_enc_offset(motor, motor->calibration_current * motor->phase_resistance))
+    }
+
+    // Phase parameters and gains may have been loaded from flash,
+    // set phase_params_valid to false to measure them again.
+    if (!motor->phase_params_valid) {
+        if (!measure_phase_resistance(motor, motor->calibration_current, 1.0f))
+            return false;
+        if (!measure_phase_inductance(motor, -1.0f, 1.0f))
+            return false;
+
+        // Calculate current control gains
+        motor->current_control.p_gain = motor->current_control.bandwidth * motor->phase_inductance;
+        float plant_pole = motor->phase_resistance / motor->phase_inductance;
+        motor->current_control.i_gain = plant_pole * motor->current_control.p_gain;
+
+        // Calculate rotor pll gains
+        float rotor_pll_bandwidth = 1000.0f; // [rad/s]
+        motor->rotor.pll_kp = 2.0f * rotor_pll_bandwidth;
+        // Critically damped
+        motor->rotor.pll_ki = 0.25f * (motor->rotor.pll_kp * motor->rotor.pll_kp);
+
+        motor->phase_params_valid = true;
+    }
+
+    float enc_calib_voltage = motor->calibration_current * motor->phase_resistance;
+    if (motor->sensorless_mode) {
+        // The observer estimates the phase directly, no encoder to align
+        motor->rotor.motor_dir = 1;
+    } else if (motor->rotor.use_index) {
+        // Offset relative to the index survives power cycles, so it only needs measuring once
+        if (!index_search(motor, enc_calib_voltage))
+            return false;
+        if (!motor->rotor.index_offset_valid) {
+            if (!calib_enc_offset(motor, enc_calib_voltage))
+                return false;
+            motor->rotor.index_offset_valid = true;
+        }
+    } else if (!calib_enc_offset(motor, enc_calib_voltage)) {
         return false;
-    
-    // Calculate current control gains
-    float current_control_bandwidth = 1000.0f; // [rad/s]
-    motor->current_control.p_gain = current_control_bandwidth * motor->phase_inductance;
-    float plant_pole = motor->phase_resistance / motor->phase_inductance;
-    motor->current_control.i_gain = plant_pole * motor->current_control.p_gain;
-
-    // Calculate rotor pll gains
-    float rotor_pll_bandwidth = 1000.0f; // [rad/s]
-    motor->rotor.pll_kp = 2.0f * rotor_pll_bandwidth;
+    }
+
     // Check that we don't get problems with discrete time approximation
-    if (!(CURRENT_MEAS_PERIOD * motor->rotor.pll_kp < 1.0f)){
+    // The current loop sees about 1.5 periods of delay, limit its phase lag at crossover to about 25deg
+    if (!(current_meas_period * motor->rotor.pll_kp < 1.0f) ||
+            !(current_meas_period * motor->current_control.bandwidth < 0.3f)){
         motor->error = ERROR_CALIBRATION_TIMING;
         return false;
     }
-    // Critically damped
-    motor->rotor.pll_ki = 0.25f * (motor->rotor.pll_kp * motor->rotor.pll_kp);
-    
+
     motor->calibration_ok = true;
     return true;
 }
@@ -1001,7 +1552,7 @@ static bool motor_calibration(Motor_t* motor){
 
 static void scan_motor_loop(Motor_t* motor, float omega, float voltage_magnitude) {
     for (;;) {
-        for (float ph = 0.0f; ph < 2.0f * M_PI; ph += omega * CURRENT_MEAS_PERIOD) {
+        for (float ph = 0.0f; ph < 2.0f * M_PI; ph += omega * current_meas_period) {
             osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, osWaitForever);
             float v_alpha = voltage_magnitude * arm_cos_f32(ph);
             float v_beta  = voltage_magnitude * arm_sin_f32(ph);
@@ -1018,6 +1569,7 @@ static void scan_motor_loop(Motor_t* motor, float omega, float voltage_magnitude
 }
 
 static void FOC_voltage_loop(Motor_t* motor, float v_d, float v_q) {
+    reset_encoder_edges(&motor->rotor);
     for (;;) {
         osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, osWaitForever);
         update_rotor(&motor->rotor);
@@ -1042,10 +1594,83 @@ static void FOC_voltage_loop(Motor_t* motor, float v_d, float v_q) {
 // Main motor control
 //--------------------------------
 
+// Discards the edge history, needed when update_rotor hasn't been running
+// (the 16bit edge timer can't be extended across long gaps) or the encoder count was changed.
+static void reset_encoder_edges(Rotor_t* rotor) {
+    TIM_TypeDef* edge_tim = rotor->edge_timer->Instance;
+    (void)edge_tim->CCR1; // clears pending capture
+    rotor->edge_timer_last = edge_tim->CNT;
+    rotor->edge_valid = false;
+    rotor->edge_vel = 0.0f;
+}
+
+// Encoder position between counts, extrapolated from the timestamps of the encoder A rising edges [counts]
+// Must be called once per control period, after updating encoder_state.
+static float interpolate_encoder_pos(Rotor_t* rotor) {
+    static const float s_per_tick = 1.0f / (float)TIM_APB1_CLOCK_HZ;
+    static const float edge_timeout = 1.0f; // [s] no extrapolation after this
+    static const float edge_history_timeout = 20.0f; // [s] well within the 51s range of edge_timer_now
+    TIM_TypeDef* edge_tim = rotor->edge_timer->Instance;
+    TIM_TypeDef* enc_tim = rotor->encoder_timer->Instance;
+
+    // Both timers capture on the same edge. Reading CCR1 clears the capture flag,
+    // so if it is set again afterwards, an edge arrived while reading: read again.
+    bool new_edge = edge_tim->SR & TIM_SR_CC1IF;
+    uint16_t edge_ticks = edge_tim->CCR1;
+    uint16_t edge_enc = enc_tim->CCR1;
+    uint16_t now_ticks = edge_tim->CNT;
+    if (edge_tim->SR & TIM_SR_CC1IF) {
+        new_edge = true;
+        edge_ticks = edge_tim->CCR1;
+        edge_enc = enc_tim->CCR1;
+        now_ticks = edge_tim->CNT;
+    }
+
+    // Extend the 16bit timer, it wraps every 780us
+    rotor->edge_timer_now += (uint16_t)(now_ticks - rotor->edge_timer_last);
+    rotor->edge_timer_last = now_ticks;
+
+    if (new_edge) {
+        uint32_t edge_time = rotor->edge_timer_now - (uint16_t)(now_ticks - edge_ticks);
+        int32_t edge_count = rotor->encoder_state + (int16_t)(edge_enc - (uint16_t)rotor->encoder_state);
+        if (rotor->edge_valid) {
+            float dt = (float)(edge_time - rotor->edge_time) * s_per_tick;
+            rotor->edge_vel = (float)(edge_count - rotor->edge_count) / dt;
+        }
+        rotor->edge_time = edge_time;
+        rotor->edge_count = edge_count;
+        rotor->edge_valid = true;
+    }
+
+    float age = (float)(rotor->edge_timer_now - rotor->edge_time) * s_per_tick;
+    if (rotor->edge_valid && age > edge_history_timeout)
+        rotor->edge_valid = false;
+    if (!rotor->edge_valid || age > edge_timeout) {
+        // Stopped, or slower than one A edge per edge_timeout. The last edge is kept,
+        // so the next one still measures the speed.
+        rotor->edge_vel = 0.0f;
+        return (float)rotor->encoder_state;
+    }
+
+    // The next A rising edge is 4 counts away and hasn't arrived yet, which bounds the speed
+    float vel = rotor->edge_vel;
+    float max_vel = 4.0f / age;
+    if (vel > max_vel) vel = max_vel;
+    if (vel < -max_vel) vel = -max_vel;
+
+    // Never stray further than one count from the measured count
+    float pos = (float)rotor->edge_count + vel * age;
+    float pos_meas = (float)rotor->encoder_state;
+    if (pos > pos_meas + 1.0f) pos = pos_meas + 1.0f;
+    if (pos < pos_meas - 1.0f) pos = pos_meas - 1.0f;
+    return pos;
+}
+
 static void update_rotor(Rotor_t* rotor) {
     // update internal encoder state
     int16_t delta_enc = (int16_t)rotor->encoder_timer->Instance->CNT - (int16_t)rotor->encoder_state;
     rotor->encoder_state += (int32_t)delta_enc;
+    float interp_pos = interpolate_encoder_pos(rotor);
 
     // compute electrical phase
     int corrected_enc = rotor->encoder_state % ENCODER_CPR;
@@ -1058,17 +1683,118 @@ static void update_rotor(Rotor_t* rotor) {
     // run pll (for now pll is in units of encoder counts)
     // TODO pll_pos runs out of precision very quickly here! Perhaps decompose into integer and fractional part?
     // Predict current pos
-    rotor->pll_pos += CURRENT_MEAS_PERIOD * rotor->pll_vel;
-    // discrete phase detector
-    float delta_pos = (float)(rotor->encoder_state - (int32_t)floorf(rotor->pll_pos));
+    rotor->pll_pos += current_meas_period * rotor->pll_vel;
+    // phase detector on the interpolated position
+    float delta_pos = interp_pos - rotor->pll_pos;
     // pll feedback
-    rotor->pll_pos += CURRENT_MEAS_PERIOD * rotor->pll_kp * delta_pos;
-    rotor->pll_vel += CURRENT_MEAS_PERIOD * rotor->pll_ki * delta_pos;
+    rotor->pll_pos += current_meas_period * rotor->pll_kp * delta_pos;
+    rotor->pll_vel += current_meas_period * rotor->pll_ki * delta_pos;
+}
+
+// Nonlinear flux observer, see equation 8 in:
+// Lee, Hong, Nam, Ortega, Praly, Astolfi: "Sensorless Control of Surface-Mount Permanent-Magnet
+// Synchronous Motors Based on a Nonlinear Observer", IEEE Trans. Power Electronics, 2010
+static void update_sensorless(Motor_t* motor) {
+    Sensorless_t* est = &motor->sensorless;
+    float R = motor->phase_resistance;
+    float L = motor->phase_inductance;
+
+    // Clarke transform
+    float I_alpha_beta[2] = {
+        -motor->current_meas.phB - motor->current_meas.phC,
+        one_by_sqrt3 * (motor->current_meas.phB - motor->current_meas.phC)
+    };
+
+    // Integrate the stator flux, eta is the resulting estimate of the magnet flux
+    float eta[2];
+    for (int i = 0; i < 2; ++i) {
+        est->flux_state[i] += (est->v_alpha_beta_memory[i] - R * I_alpha_beta[i]) * current_meas_period;
+        eta[i] = est->flux_state[i] - L * I_alpha_beta[i];
+    }
+
+    // Observer action pulls the magnitude of eta towards the known magnet flux linkage
+    float pm_flux_sqr = est->pm_flux_linkage * est->pm_flux_linkage;
+    float est_pm_flux_sqr = eta[0] * eta[0] + eta[1] * eta[1];
+    float eta_factor = 0.5f * (est->observer_gain / pm_flux_sqr) * (pm_flux_sqr - est_pm_flux_sqr);
+    for (int i = 0; i < 2; ++i) {
+        est->flux_state[i] += eta_factor * eta[i] * current_meas_period;
+        eta[i] = est->flux_state[i] - L * I_alpha_beta[i];
+    }
+
+    // Timings queued in the last cycle are applied from this measurement until the next
+    est->v_alpha_beta_memory[0] = motor->current_control.final_v_alpha;
+    est->v_alpha_beta_memory[1] = motor->current_control.final_v_beta;
+
+    // run pll on the observer phase
+    est->phase = fast_atan2(eta[1], eta[0]);
+    est->pll_pos = wrap_pm_pi(est->pll_pos + current_meas_period * est->pll_vel);
+    float delta_phase = wrap_pm_pi(est->phase - est->pll_pos);
+    est->pll_pos = wrap_pm_pi(est->pll_pos + current_meas_period * est->pll_kp * delta_phase);
+    est->pll_vel += current_meas_period * est->pll_ki * delta_phase;
+
+    // Present the estimate in encoder units, so the control loops run unchanged
+    motor->rotor.phase = est->phase;
+    motor->rotor.pll_vel = est->pll_vel / elec_rad_per_enc;
+    motor->rotor.pll_pos += current_meas_period * motor->rotor.pll_vel;
+}
+
+// Open loop current ramp up to a speed where the flux observer is reliable.
+// Returns true if the observer locked on, and the closed loop control can take over.
+static bool spin_up_sensorless(Motor_t* motor) {
+    Sensorless_t* est = &motor->sensorless;
+    float dir = (est->spin_up_target_vel >= 0.0f) ? 1.0f : -1.0f;
+    float target_vel = fabsf(est->spin_up_target_vel);
+
+    // Don't spin the motor up just to stop it again in control_motor_loop
+    if (motor->control_mode >= CTRL_MODE_POSITION_CONTROL) {
+        motor->error = ERROR_SENSORLESS_POSITION_CONTROL;
+        return false;
+    }
+
+    // Reset estimator and current control
+    for (int i = 0; i < 2; ++i) {
+        est->flux_state[i] = 0.0f;
+        est->v_alpha_beta_memory[i] = 0.0f;
+    }
+    est->pll_pos = 0.0f;
+    est->pll_vel = 0.0f;
+    motor->rotor.pll_pos = 0.0f;
+    motor->current_control.v_current_control_integral_d = 0.0f;
+    motor->current_control.v_current_control_integral_q = 0.0f;
+    motor->current_control.final_v_alpha = 0.0f;
+    motor->current_control.final_v_beta = 0.0f;
+
+    float phase = 0.0f;
+    float vel = 0.0f;
+    while (vel < target_vel) {
+        if (!motor->enable_control)
+            return false;
+        if(osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal){
+            motor->error = ERROR_FOC_MEASUREMENT_TIMEOUT;
+            return false;
+        }
+        // Let the observer converge while the ramp is running
+        update_sensorless(motor);
+
+        vel += est->spin_up_acceleration * current_meas_period;
+        phase = wrap_pm_pi(phase + dir * vel * current_meas_period);
+
+        // Current along the ramp drags the rotor d axis along, like a stepper motor
+        if (!FOC_current(motor, est->spin_up_current, 0.0f, phase))
+            return false; // motor->error has been set by FOC_current
+    }
+
+    if (fabsf(est->pll_vel - dir * target_vel) > 0.5f * target_vel) {
+        motor->error = ERROR_SENSORLESS_SPIN_UP;
+        return false;
+    }
+    motor->vel_integrator_current = 0.0f;
+    return true;
 }
 
 static void update_brake_current(float brake_current) {
     if (brake_current < 0.0f) brake_current = 0.0f;
-    float brake_duty = brake_current * brake_resistance / vbus_voltage;
+    float brake_duty = brake_current * brake.resistance * ((2.0f / 3.0f) * vbus_V_to_mod);
 
     // Duty limit at 90% to allow bootstrap caps to charge
     if (brake_duty > 0.9f) brake_duty = 0.9f;
@@ -1085,22 +1811,209 @@ static void update_brake_current(float brake_current) {
     htim2.Instance->CCR4 = high_on;
 }
 
+// Bus manager, runs once per PWM period from the ADC interrupt, so it is the only writer of the brake PWM.
+// The regenerated power of all motors (their negative Ibus) is dumped into the brake resistor as a
+// feedforward, and a PI controller on vbus takes up the estimation error above vbus_brake_start.
+static void update_brake() {
+    // Checked even with the brake disabled. Once the motors are off it has done its job,
+    // and keeps the first error instead of overwriting it every period.
+    if (vbus_voltage > brake.vbus_overvoltage_trip && any_motor_armed())
+        global_fault(ERROR_DC_BUS_OVERVOLTAGE);
+
+    if (!brake.enabled || !(brake.resistance > 0.0f)) {
+        brake.current = 0.0f;
+        update_brake_current(0.0f);
+        return;
+    }
+
+    float Ibus_sum = 0.0f;
+    for (int i = 0; i < num_motors; ++i)
+        Ibus_sum += motors[i].current_control.Ibus;
+
+    // The PI only ever adds brake current, so its integral is kept between 0 and the full brake current
+    float max_current = 0.9f * vbus_voltage / brake.resistance; // duty limit of update_brake_current
+    // At the thermal limit only the continuous rating is left. The motors stop, so the bus
+    // stops rising, but the brake keeps taking what it safely can.
+    bool overloaded = brake.thermal_time_constant > 0.0f
+            && brake.energy >= brake.power_rating * brake.thermal_time_constant;
+    if (overloaded) {
+        if (vbus_voltage > 0.0f && max_current > brake.power_rating / vbus_voltage)
+            max_current = brake.power_rating / vbus_voltage;
+        if (any_motor_armed())
+            global_fault(ERROR_BRAKE_OVERLOAD);
+    }
+    float v_err = vbus_voltage - brake.vbus_brake_start;
+    brake.vbus_integral += (brake.vbus_i_gain * current_meas_period) * v_err;
+    if (brake.vbus_integral < 0.0f) brake.vbus_integral = 0.0f;
+    if (brake.vbus_integral > max_current) brake.vbus_integral = max_current;
+
+    float brake_current = -Ibus_sum + brake.vbus_p_gain * v_err + brake.vbus_integral;
+    if (brake_current < 0.0f) brake_current = 0.0f;
+    if (brake_current > max_current) brake_current = max_current;
+    brake.current = brake_current;
+    update_brake_current(brake_current);
+
+    // Thermal model: the resistor heats up with the dissipated power and cools down with
+    // thermal_time_constant, so at power_rating the energy settles at power_rating * thermal_time_constant.
+    // Without a time constant there is no model, and no overload protection.
+    if (brake.thermal_time_constant > 0.0f) {
+        float power = brake_current * vbus_voltage;
+        brake.energy += (power - brake.energy / brake.thermal_time_constant) * current_meas_period;
+    }
+}
+
+// nFAULT is shared by both DRV8301 and can't get an EXTI interrupt (line 2 belongs to the
+// GPIO_1 step input), so it is polled once per PWM period from the ADC interrupt instead.
+// On a new fault the bridges are stopped right away, then the status registers of both
+// gate drivers are read in the background to find out which one tripped and why.
+// nFAULT is ignored while the bus is below GATE_DRIVER_MIN_VBUS, unless a motor is armed:
+// then an undervoltage is a real fault, the gate drivers have shut down their bridges.
+static void check_gate_driver_fault() {
+    static bool fault_active = false;
+    static bool status_pending = false;
+    static int vbus_up_periods = 0;
+
+    int wake_periods = GATE_DRIVER_WAKE_TIME * current_meas_hz / 1000;
+    if (vbus_voltage_raw < GATE_DRIVER_MIN_VBUS)
+        vbus_up_periods = 0;
+    else if (vbus_up_periods < wake_periods)
+        ++vbus_up_periods;
+    bool watch = gate_drivers_initialized && (vbus_up_periods >= wake_periods || any_motor_armed());
+
+    bool fault = watch && HAL_GPIO_ReadPin(nFAULT_GPIO_Port, nFAULT_Pin) == GPIO_PIN_RESET;
+    if (fault && !fault_active) {
+        global_fault(ERROR_GATE_DRIVER_FAULT);
+        for (int i = 0; i < num_motors; ++i)
+            DRV8301_readStatusAsync(&motors[i].gate_driver, &motors[i].gate_driver_regs);
+        status_pending = true;
+    }
+    fault_active = fault;
+
+    if (status_pending) {
+        for (int i = 0; i < num_motors; ++i) {
+            if (motors[i].gate_driver.statusBusy)
+                return;
+        }
+        for (int i = 0; i < num_motors; ++i)
+            motors[i].gate_driver_fault = decode_gate_driver_status(&motors[i].gate_driver_regs);
+        status_pending = false;
+    }
+}
+
+static int decode_gate_driver_status(const DRV_SPI_8301_Vars_t* regs) {
+    const DRV_SPI_8301_Stat1_t_* stat1 = &regs->Stat_Reg_1;
+    int fault = 0;
+    if (stat1->FETHA_OC) fault |= GATE_DRIVER_FAULT_FETHA_OC;
+    if (stat1->FETLA_OC) fault |= GATE_DRIVER_FAULT_FETLA_OC;
+    if (stat1->FETHB_OC) fault |= GATE_DRIVER_FAULT_FETHB_OC;
+    if (stat1->FETLB_OC) fault |= GATE_DRIVER_FAULT_FETLB_OC;
+    if (stat1->FETHC_OC) fault |= GATE_DRIVER_FAULT_FETHC_OC;
+    if (stat1->FETLC_OC) fault |= GATE_DRIVER_FAULT_FETLC_OC;
+    if (stat1->OTSD) fault |= GATE_DRIVER_FAULT_OTSD;
+    if (stat1->PVDD_UV) fault |= GATE_DRIVER_FAULT_PVDD_UV;
+    if (stat1->GVDD_UV) fault |= GATE_DRIVER_FAULT_GVDD_UV;
+    if (regs->Stat_Reg_2.GVDD_OV) fault |= GATE_DRIVER_FAULT_GVDD_OV;
+    return fault;
+}
+
+// Spreads the period corrections requested by pwm_sync_cb over the following PWM periods.
+// Runs once per period right after the TIM1 top, while TIM8 is still far from its top,
+// so both timers reach their next top with the ARR written here and keep their offset.
+// Without ARR preload the new value applies at that next top, each count adding 2 clocks.
+static void update_pwm_sync() {
+    int pending = (int32_t)(pwm_sync.correction - pwm_sync.applied);
+    int max_step = pwm_period_clocks / PWM_SYNC_MAX_STEP_DIV;
+    int step = pending / 2;
+    if (step > max_step) step = max_step;
+    if (step < -max_step) step = -max_step;
+    uint16_t arr = pwm_period_clocks + step;
+    for (int i = 0; i < num_motors; ++i)
+        motors[i].motor_timer->Instance->ARR = arr;
+    pwm_sync.applied += 2 * step;
+}
+
 static void queue_modulation_timings(Motor_t* motor, float mod_alpha, float mod_beta) {
-    float tA, tB, tC;
-    SVM(mod_alpha, mod_beta, &tA, &tB, &tC);
-    motor->next_timings[0] = (uint16_t)(tA * (float)TIM_1_8_PERIOD_CLOCKS);
-    motor->next_timings[1] = (uint16_t)(tB * (float)TIM_1_8_PERIOD_CLOCKS);
-    motor->next_timings[2] = (uint16_t)(tC * (float)TIM_1_8_PERIOD_CLOCKS);
+    float t[3];
+    SVM(mod_alpha, mod_beta, &t[0], &t[1], &t[2]);
+
+    if (motor->discontinuous_pwm) {
+        // DPWMMIN: shift all phases until the lowest one sits on the negative rail.
+        // That phase stops switching, its low side stays on, and the others get
+        // more low side on-time, so the current measurement window only gets longer.
+        int i_max = 0;
+        if (t[1] > t[i_max]) i_max = 1;
+        if (t[2] > t[i_max]) i_max = 2;
+        float shift = 1.0f - t[i_max];
+        for (int i = 0; i < 3; ++i)
+            t[i] += shift;
+        t[i_max] = 1.0f; // exactly, regardless of rounding
+    }
+
+    // Dead time compensation
+    // During the dead time the current freewheels through a diode, so a phase with current
+    // flowing out of the bridge only goes high once its high side switch turns on, a dead time late.
+    // This happens once per up-down period, so the compare value moves by half the dead time.
+    // Near zero current the direction is uncertain, so fade in across dead_time_comp_band.
+    float I[3] = {
+        -motor->current_meas.phB - motor->current_meas.phC,
+        motor->current_meas.phB,
+        motor->current_meas.phC
+    };
+    float comp_max = 0.5f * motor->dead_time_comp;
+    float band = motor->dead_time_comp_band > 0.01f ? motor->dead_time_comp_band : 0.01f;
+    float comp_per_amp = comp_max / band;
+    for (int i = 0; i < 3; ++i) {
+        // No edges at all, not even while the PWM_SYNC trim lengthens the period
+        if (t[i] >= 1.0f) {
+            motor->next_timings[i] = PWM_TIMING_NEVER_MATCHES;
+            continue;
+        }
+        float comp = comp_per_amp * I[i];
+        if (comp > comp_max) comp = comp_max;
+        if (comp < -comp_max) comp = -comp_max;
+        float timing = t[i] * (float)pwm_period_clocks - comp;
+        if (timing < 0.0f) timing = 0.0f;
+        if (timing > (float)pwm_period_clocks) timing = (float)pwm_period_clocks;
+        motor->next_timings[i] = (uint16_t)timing;
+    }
 }
 
 static void queue_voltage_timings(Motor_t* motor, float v_alpha, float v_beta) {
-    float vfactor = 1.0f / ((2.0f / 3.0f) * vbus_voltage);
-    float mod_alpha = vfactor * v_alpha;
-    float mod_beta = vfactor * v_beta;
+    float mod_alpha = vbus_V_to_mod * v_alpha;
+    float mod_beta = vbus_V_to_mod * v_beta;
     queue_modulation_timings(motor, mod_alpha, mod_beta);
 }
 
-static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des) {
+static void update_power_meter(Motor_t* motor, float Id, float Iq) {
+    Power_meter_t* meter = &motor->power;
+    float k = power_filter_k;
+
+    // With the magnitude invariant transforms, P = 3/2 * (Vd*Id + Vq*Iq) = vbus * Ibus,
+    // and the phase current RMS is the current vector magnitude / sqrt(2)
+    float power = vbus_voltage * motor->current_control.Ibus;
+    float Isq = Id*Id + Iq*Iq;
+    if (power > 0.0f)
+        kahan_sum_add(&meter->energy_in, power * current_meas_period);
+    else
+        kahan_sum_add(&meter->energy_out, -power * current_meas_period);
+
+    meter->electrical_power += (power - meter->electrical_power) * k;
+    meter->Isq_filtered += (Isq - meter->Isq_filtered) * k;
+    meter->copper_loss = 1.5f * motor->phase_resistance * meter->Isq_filtered;
+    meter->Irms = sqrtf(0.5f * meter->Isq_filtered);
+
+    // The copper loss is the only loss modelled, so this is an upper bound
+    float P_elec = meter->electrical_power;
+    float P_mech = P_elec - meter->copper_loss;
+    if (P_elec > EFFICIENCY_MIN_POWER)
+        meter->efficiency = P_mech / P_elec;
+    else if (P_elec < -EFFICIENCY_MIN_POWER)
+        meter->efficiency = P_elec / P_mech;
+    else
+        meter->efficiency = 0.0f;
+}
+
+static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des, float phase) {
     Current_control_t* ictrl = &motor->current_control;
 
     // Clarke transform
@@ -1108,10 +2021,11 @@ static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des) {
     float Ibeta = one_by_sqrt3 * (motor->current_meas.phB - motor->current_meas.phC);
 
     // Park transform
-    float c = arm_cos_f32(motor->rotor.phase);
-    float s = arm_sin_f32(motor->rotor.phase);
+    float c = arm_cos_f32(phase);
+    float s = arm_sin_f32(phase);
     float Id = c*Ialpha + s*Ibeta;
     float Iq = c*Ibeta  - s*Ialpha;
+    ictrl->Iq_measured = Iq;
 
     // Current error
     float Ierr_d = Id_des - Id;
@@ -1122,44 +2036,45 @@ static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des) {
     float Vd = ictrl->v_current_control_integral_d + Ierr_d * ictrl->p_gain;
     float Vq = ictrl->v_current_control_integral_q + Ierr_q * ictrl->p_gain;
 
-    float vfactor = 1.0f / ((2.0f / 3.0f) * vbus_voltage);
+    float mod_to_V = vbus_mod_to_V;
+    float vfactor = vbus_V_to_mod;
     float mod_d = vfactor * Vd;
     float mod_q = vfactor * Vq;
 
+    // Inverse park transform
+    float mod_alpha = c*mod_d - s*mod_q;
+    float mod_beta  = c*mod_q + s*mod_d;
+
     // Vector modulation saturation, lock integrator if saturated
-    // TODO make maximum modulation configurable
-    float mod_scalefactor = 0.80f * sqrt3_by_2 * 1.0f/sqrtf(mod_d*mod_d + mod_q*mod_q);
+    // Scaling preserves the angle, limit is the inscribed circle or the hexagon, shrunk by max_modulation
+    float max_modulation = ictrl->max_modulation;
+    if (max_modulation > 1.0f) max_modulation = 1.0f;
+    float mod_scalefactor;
+    if (ictrl->overmodulation)
+        mod_scalefactor = max_modulation / svm_hex_norm(mod_alpha, mod_beta);
+    else
+        mod_scalefactor = max_modulation * sqrt3_by_2 * 1.0f/sqrtf(mod_d*mod_d + mod_q*mod_q);
     if (mod_scalefactor < 1.0f)
     {
         mod_d *= mod_scalefactor;
         mod_q *= mod_scalefactor;
+        mod_alpha *= mod_scalefactor;
+        mod_beta *= mod_scalefactor;
         // TODO make decayfactor configurable
         ictrl->v_current_control_integral_d *= 0.99f;
         ictrl->v_current_control_integral_q *= 0.99f;
     } else {
-        ictrl->v_current_control_integral_d += Ierr_d * (ictrl->i_gain * CURRENT_MEAS_PERIOD);
-        ictrl->v_current_control_integral_q += Ierr_q * (ictrl->i_gain * CURRENT_MEAS_PERIOD);
+        ictrl->v_current_control_integral_d += Ierr_d * (ictrl->i_gain * current_meas_period);
+        ictrl->v_current_control_integral_q += Ierr_q * (ictrl->i_gain * current_meas_period);
     }
 
-    // Compute estimated bus current
+    // Compute estimated bus current, for the brake feedforward in update_brake
     ictrl->Ibus = mod_d * Id + mod_q * Iq;
+    update_power_meter(motor, Id, Iq);
 
-    // If this is last motor, update brake resistor duty
-    // if (motor == &motors[num_motors-1]) {
-    // Above check doesn't work if last motor is executing voltage control
-    // TODO trigger this update in control_motor_loop instead,
-    // and make voltage control a control mode in it.
-        float Ibus_sum = 0.0f;
-        for (int i = 0; i < num_motors; ++i) {
-            Ibus_sum += motors[i].current_control.Ibus;
-        }
-        // Note: function will clip negative values to 0.0f
-        update_brake_current(-Ibus_sum);
-    // }
-
-    // Inverse park transform
-    float mod_alpha = c*mod_d - s*mod_q;
-    float mod_beta  = c*mod_q + s*mod_d;
+    // Report final applied voltage
+    ictrl->final_v_alpha = mod_to_V * mod_alpha;
+    ictrl->final_v_beta = mod_to_V * mod_beta;
 
     // Apply SVM
     queue_modulation_timings(motor, mod_alpha, mod_beta);
@@ -1173,20 +2088,84 @@ static bool FOC_current(Motor_t* motor, float Id_des, float Iq_des) {
     return true;
 }
 
+static void reset_step_input(Motor_t* motor) {
+    Step_filter_t* filter = &motor->step_filter;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    filter->input = 0.0f;
+    __set_PRIMASK(primask);
+    filter->error = 0.0f;
+    filter->vel = 0.0f;
+}
+
+// Passes the steps received since the last control cycle on to pos_setpoint, through the
+// step filter if it is enabled. The filter is a type 2 loop like the encoder PLL: it
+// follows a constant step rate without lag, and during acceleration it lags by accel / ki.
+// Its velocity is the feedforward, so the position loop doesn't see the step jumps.
+static void update_step_input(Motor_t* motor, float counts) {
+    Step_filter_t* filter = &motor->step_filter;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    counts += filter->input;
+    filter->input = 0.0f;
+    __set_PRIMASK(primask);
+
+    if (!filter->enabled) {
+        // Hand over what the filter still held when it was switched off
+        motor->pos_setpoint += filter->error + counts;
+        filter->error = 0.0f;
+        filter->vel = 0.0f;
+        return;
+    }
+
+    filter->error += counts;
+    // Predict
+    float move = current_meas_period * filter->vel;
+    filter->error -= move;
+    // Feedback
+    float correction = current_meas_period * filter->kp * filter->error;
+    filter->vel += current_meas_period * filter->ki * filter->error;
+    filter->error -= correction;
+    motor->pos_setpoint += move + correction;
+}
+
 static void control_motor_loop(Motor_t* motor) {
+    bool counts_steps = step_counter.active && motor == &motors[1];
+    reset_encoder_edges(&motor->rotor);
+    // Drop the steps that came while control was off
+    if (counts_steps)
+        take_counted_steps();
+    reset_step_input(motor);
     while (motor->enable_control) {
         if(osSignalWait(M_SIGNAL_PH_CURRENT_MEAS, PH_CURRENT_MEAS_TIMEOUT).status != osEventSignal){
             motor->error = ERROR_FOC_MEASUREMENT_TIMEOUT;
             break;
         }
-        update_rotor(&motor->rotor);
+        if (motor->sensorless_mode)
+            update_sensorless(motor);
+        else
+            update_rotor(&motor->rotor);
+
+        float step_counts = 0.0f;
+        if (counts_steps)
+            step_counts = take_counted_steps() * motor->counts_per_step;
+        if (motor->enable_step_dir)
+            update_step_input(motor, step_counts);
+        else
+            reset_step_input(motor); // no stale step_filter.vel feedforward while step/dir is off
+
+        // Sensorless there is no absolute position to control, the mode can be changed at any time
+        if (motor->sensorless_mode && motor->control_mode >= CTRL_MODE_POSITION_CONTROL) {
+            motor->error = ERROR_SENSORLESS_POSITION_CONTROL;
+            break;
+        }
 
         // Position control
         // TODO Decide if we want to use encoder or pll position here
         float vel_des = motor->vel_setpoint;
         if (motor->control_mode >= CTRL_MODE_POSITION_CONTROL) {
             float pos_err = motor->pos_setpoint - motor->rotor.pll_pos;
-            vel_des += motor->pos_gain * pos_err;
+            vel_des += motor->pos_gain * pos_err + motor->step_filter.vel;
         }
 
         // Velocity limiting
@@ -1207,8 +2186,19 @@ static void control_motor_loop(Motor_t* motor) {
         // Apply motor direction correction
         Iq *= motor->rotor.motor_dir;
 
-        // Current limiting
+        // Current limiting, derated linearly to zero between the FET temperature limits
         float Ilim = motor->current_control.current_lim;
+        if (motor->fet_temp_derating) {
+            if (!motor->fet_thermistor.valid) {
+                motor->error = ERROR_FET_THERMISTOR_INVALID;
+                break;
+            }
+            float T = motor->fet_thermistor.temperature;
+            if (T >= motor->fet_temp_derate_stop)
+                Ilim = 0.0f;
+            else if (T > motor->fet_temp_derate_start)
+                Ilim *= (motor->fet_temp_derate_stop - T) / (motor->fet_temp_derate_stop - motor->fet_temp_derate_start);
+        }
         bool limited = false;
         if (Iq > Ilim) {
             limited = true;
@@ -1228,19 +2218,15 @@ static void control_motor_loop(Motor_t* motor) {
                 // TODO make decayfactor configurable
                 motor->vel_integrator_current *= 0.99f;
             } else {
-                motor->vel_integrator_current += (motor->vel_integrator_gain * CURRENT_MEAS_PERIOD) * v_err;
+                motor->vel_integrator_current += (motor->vel_integrator_gain * current_meas_period) * v_err;
             }
         }
 
         // Execute current command
-        if(!FOC_current(motor, 0.0f, Iq)){
+        if(!FOC_current(motor, 0.0f, Iq, motor->rotor.phase)){
             break; // in case of error exit loop, motor->error has been set by FOC_current
         }
     }
-
-    //We are exiting control, reset Ibus, and update brake current
-    //TODO update brake current from all motors in 1 func
-    //TODO reset this motor Ibus, then call from here
 }
 
 
@@ -1266,8 +2252,17 @@ void motor_thread(void const * argument) {
         if (motor->calibration_ok && motor->enable_control) {
             motor->enable_step_dir = true;
             __HAL_TIM_MOE_ENABLE(motor->motor_timer);
-            control_motor_loop(motor);
+            if (!motor->sensorless_mode || spin_up_sensorless(motor))
+                control_motor_loop(motor);
             __HAL_TIM_MOE_DISABLE_UNCONDITIONALLY(motor->motor_timer);
+            // Stop feeding the brake with the last bus current of this motor, the energy totals are kept
+            motor->current_control.Ibus = 0.0f;
+            motor->current_control.Iq_measured = 0.0f;
+            motor->power.electrical_power = 0.0f;
+            motor->power.copper_loss = 0.0f;
+            motor->power.efficiency = 0.0f;
+            motor->power.Irms = 0.0f;
+            motor->power.Isq_filtered = 0.0f;
             motor->enable_step_dir = false;
             if(motor->enable_control){ // if control is still enabled, we exited because of error
                 motor->calibration_ok = false;
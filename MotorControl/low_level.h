@@ -5,9 +5,13 @@
 /* Includes ------------------------------------------------------------------*/
 #include <cmsis_os.h>
 #include "drv8301.h"
+#include "utils.h"
 
 //default timeout waiting for phase measurement signals
 #define PH_CURRENT_MEAS_TIMEOUT 2 // [ms]
+// Range of pwm_frequency
+#define PWM_FREQUENCY_MIN 4000 // [Hz]
+#define PWM_FREQUENCY_MAX 40000 // [Hz]
 
 /* Exported types ------------------------------------------------------------*/
 typedef enum {
@@ -33,8 +37,31 @@ typedef enum {
     ERROR_GATEDRIVER_INVALID_GAIN,
     ERROR_PWM_SRC_FAIL,
     ERROR_UNEXPECTED_STEP_SRC,
+    ERROR_DC_CAL_TIMEOUT,
+    ERROR_SENSORLESS_SPIN_UP,
+    ERROR_INDEX_SEARCH_TIMEOUT,
+    ERROR_FET_THERMISTOR_INVALID,
+    ERROR_DC_BUS_OVERVOLTAGE,
+    ERROR_BRAKE_OVERLOAD,
+    ERROR_GATE_DRIVER_FAULT,
+    ERROR_SENSORLESS_POSITION_CONTROL,
 } Error_t;
 
+// Decoded DRV8301 status registers, read after nFAULT was asserted.
+// One bit per cause, so several can be reported at once.
+typedef enum {
+    GATE_DRIVER_FAULT_FETHA_OC = 1 << 0,
+    GATE_DRIVER_FAULT_FETLA_OC = 1 << 1,
+    GATE_DRIVER_FAULT_FETHB_OC = 1 << 2,
+    GATE_DRIVER_FAULT_FETLB_OC = 1 << 3,
+    GATE_DRIVER_FAULT_FETHC_OC = 1 << 4,
+    GATE_DRIVER_FAULT_FETLC_OC = 1 << 5,
+    GATE_DRIVER_FAULT_OTSD = 1 << 6,
+    GATE_DRIVER_FAULT_PVDD_UV = 1 << 7,
+    GATE_DRIVER_FAULT_GVDD_UV = 1 << 8,
+    GATE_DRIVER_FAULT_GVDD_OV = 1 << 9,
+} Gate_driver_fault_t;
+
 // Note: these should be sorted from lowest level of control to
 // highest level of control, to allow "<" style comparisons.
 typedef enum {
@@ -49,13 +76,74 @@ typedef struct {
     float phC;
 } Iph_BC_t;
 
+typedef struct {
+    float temperature; // [degC] low pass filtered
+    bool valid; // false until the first reading, or if the sensor reads open or shorted
+} Thermistor_t;
+
+// Electrical power accounting of one motor, updated every current control period.
+// Powers are low pass filtered, positive when drawing from the DC bus.
+typedef struct {
+    float electrical_power; // [W] vbus * Ibus
+    float copper_loss; // [W] in phase_resistance
+    float efficiency; // mechanical power / electrical power while motoring, the inverse while regenerating
+    float Irms; // [A] RMS phase current
+    float Isq_filtered; // [A^2] mean square of the current vector magnitude
+    Kahan_sum_t energy_in; // [J] drawn from the bus, write .sum = 0 to reset
+    Kahan_sum_t energy_out; // [J] regenerated into the bus
+} Power_meter_t;
+
+typedef struct {
+    bool enabled; // the brake resistor stays off while cleared, the overvoltage trip still works
+    float resistance; // [ohm] 0 if there is no brake resistor
+    float power_rating; // [W] continuous
+    float thermal_time_constant; // [s] of the resistor heating up
+    float vbus_brake_start; // [V] the PI controller adds brake current above this
+    float vbus_overvoltage_trip; // [V] global fault above this
+    float vbus_p_gain; // [A/V]
+    float vbus_i_gain; // [A/Vs]
+    float vbus_integral; // [A]
+    float current; // [A] commanded average brake current
+    float energy; // [J] thermal state, overload above power_rating * thermal_time_constant
+} Brake_t;
+
+// Phase lock of the TIM1/TIM8 PWM to a periodic external event, the CAN SYNC frame,
+// see pwm_sync_cb. Corrections are in timer clocks, added to the following PWM periods.
+typedef struct {
+    float integral; // [clocks per event] frequency trim against the event period
+    float residual; // [clocks] fraction of a clock not yet requested
+    uint32_t correction; // [clocks] period extension requested so far, wraps around
+    uint32_t applied; // [clocks] period extension applied so far, wraps around
+    int phase_error; // [clocks] time of the last event after the TIM1 top
+    bool locked; // phase_error is within PWM_SYNC_LOCK_CLOCKS
+} Pwm_sync_t;
+
+// Step/dir input of M1 counted by TIM9 instead of one interrupt per step, see fold_step_count.
+// Only GPIO_4 (PA3, TIM9_CH2) reaches a free timer input, so in this mode GPIO_4 is the step
+// input and GPIO_3 the direction. Only direction changes interrupt.
+typedef struct {
+    bool enabled; // applied at startup
+    bool active; // TIM9 was set up, since startup
+    bool dir; // level of the direction input after its last edge
+    uint16_t timer_count; // TIM9 count when the steps were last folded in
+    int steps; // signed steps not yet taken by the control loop
+} Step_counter_t;
+
 typedef struct {
     float current_lim; // [A]
+    // Fraction of the SVM linear range (magnitude sqrt(3)/2) the current controller may use, at most 1.
+    // Near 1 the low side on-time gets too short to measure the phase currents.
+    float max_modulation;
+    bool overmodulation; // saturate to the SVM hexagon instead of its inscribed circle
+    float bandwidth; // [rad/s] p_gain and i_gain are calculated for this during calibration, at most 0.3 * pwm_frequency
     float p_gain; // [V/A]
     float i_gain; // [V/As]
     float v_current_control_integral_d; // [V]
     float v_current_control_integral_q; // [V]
     float Ibus; // DC bus current [A]
+    float Iq_measured; // [A] in the rotor frame, not corrected for motor_dir
+    float final_v_alpha; // [V] last commanded voltage
+    float final_v_beta; // [V]
 } Current_control_t;
 
 typedef struct {
@@ -63,19 +151,60 @@ typedef struct {
     int encoder_offset;
     int encoder_state;
     int motor_dir; // 1/-1 for fwd/rev alignment to encoder.
+    bool use_index; // home on the encoder index pulse, encoder_offset is then relative to the index
+    bool index_search_active; // set while searching, the index pulse zeroes the encoder count
+    bool index_found;
+    bool index_offset_valid; // encoder_offset and motor_dir are known relative to the index, skips the offset scan
     float phase;
     float pll_pos;
     float pll_vel;
     float pll_kp;
     float pll_ki;
+    TIM_HandleTypeDef* edge_timer; // timestamps the encoder A rising edges
+    uint16_t edge_timer_last; // raw edge_timer count at the last update
+    uint32_t edge_timer_now; // [ticks] software extended edge_timer count
+    uint32_t edge_time; // [ticks] time of the last A rising edge
+    int32_t edge_count; // encoder_state at the last A rising edge
+    bool edge_valid; // edge_time and edge_count are valid
+    float edge_vel; // [counts/s] speed between the last two A rising edges
 } Rotor_t;
 
+// Sensorless rotor estimation, a nonlinear flux observer followed by a PLL.
+// All angles and speeds here are electrical.
+typedef struct {
+    float pm_flux_linkage; // [V / (rad/s)] permanent magnet flux linkage
+    float observer_gain; // [rad/s]
+    float flux_state[2]; // [Vs] alpha, beta
+    float v_alpha_beta_memory[2]; // [V] voltage applied during the last period
+    float phase; // [rad] observer output
+    float pll_pos; // [rad]
+    float pll_vel; // [rad/s]
+    float pll_kp; // [rad/s / rad]
+    float pll_ki; // [(rad/s^2) / rad]
+    float spin_up_current; // [A] open loop start current
+    float spin_up_acceleration; // [rad/s^2]
+    float spin_up_target_vel; // [rad/s] handover to closed loop at this speed, sign sets direction
+} Sensorless_t;
+
+// Tracking loop on the step/dir input, like the encoder PLL, see update_step_input.
+// Turns the step stream into a smooth pos_setpoint and a velocity feedforward.
+typedef struct {
+    bool enabled; // otherwise steps go straight to pos_setpoint
+    float kp; // [(counts/s) / count]
+    float ki; // [(counts/s^2) / count]
+    float input; // [counts] steps since the last control cycle, from the step interrupt
+    float error; // [counts] steps not yet passed on to pos_setpoint
+    float vel; // [counts/s] step rate estimate, added to the velocity command in position control
+} Step_filter_t;
+
 #define TIMING_LOG_SIZE 16
 typedef struct {
     Motor_control_mode_t control_mode;
     bool enable_step_dir;
     float counts_per_step;
+    Step_filter_t step_filter;
     int error;
+    int gate_driver_fault; // see: Gate_driver_fault_t, 0 until the DRV8301 signals a fault
     float pos_setpoint;
     float pos_gain;
     float vel_setpoint;
@@ -87,6 +216,14 @@ typedef struct {
     float calibration_current;
     float phase_inductance;
     float phase_resistance;
+    bool phase_params_valid; // phase resistance/inductance, dead time and current control gains are known, skips their measurement in calibration
+    float dead_time_comp; // [clocks] effective bridge dead time the modulation compensates for, 0 disables
+    float dead_time_comp_band; // [A] dead time compensation fades in up to this phase current
+    bool discontinuous_pwm; // DPWMMIN: the lowest phase is clamped to the negative rail, a third fewer switching events
+    Thermistor_t fet_thermistor; // on the power stage of this motor
+    bool fet_temp_derating; // derate current_lim with the FET temperature, stops control if the thermistor is not valid. Off by default.
+    float fet_temp_derate_start; // [degC] current_lim starts dropping linearly here...
+    float fet_temp_derate_stop; // [degC] ...and reaches zero here
     osThreadId motor_thread;
     bool thread_ready;
     bool enable_control; // enable/disable via usb to start motor control. will be set to false again in case of errors.requires calibration_ok=true
@@ -98,25 +235,34 @@ typedef struct {
     uint16_t last_cpu_time;
     Iph_BC_t current_meas;
     Iph_BC_t DC_calib;
+    Running_stats_t DC_calib_stats[2]; // phB, phC: used to seed DC_calib at startup
+    bool DC_calib_converged; // DC_calib is seeded and tracked by a slow filter from here on
     DRV8301_Obj gate_driver;
     DRV_SPI_8301_Vars_t gate_driver_regs; //Local view of DRV registers
     float shunt_conductance;
     float phase_current_rev_gain; //Reverse gain for ADC to Amps
     Current_control_t current_control;
+    Power_meter_t power;
     Rotor_t rotor;
+    bool sensorless_mode; // estimate rotor phase with the flux observer instead of the encoder
+    Sensorless_t sensorless;
     int timing_log_index;
     uint16_t timing_log[TIMING_LOG_SIZE];
 } Motor_t;
 
-typedef struct{
-        int type;
-        int index;
-} monitoring_slot;
-
 /* Exported constants --------------------------------------------------------*/
 extern float vbus_voltage;
+extern float vbus_voltage_raw;
+extern float vbus_ripple_ff_gain;
+extern int boot_to_ready_time;
+extern int pwm_frequency;
+extern Thermistor_t aux_thermistor;
+extern Brake_t brake;
+extern Pwm_sync_t pwm_sync;
+extern Step_counter_t step_counter;
 extern Motor_t motors[];
 extern const int num_motors;
+extern float elec_rad_per_enc;
 
 /* Exported variables --------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
@@ -130,13 +276,17 @@ void set_current_setpoint(Motor_t* motor, float current_setpoint);
 void safe_assert(int arg);
 void init_motor_control();
 void step_cb(uint16_t GPIO_Pin);
+void enc_index_cb(uint16_t GPIO_Pin);
 void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
 void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
+void temp_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected);
+void pwm_sync_cb();
+
+// Configuration persistence, both refuse while any motor is armed
+bool save_configuration();
+bool erase_configuration();
 
 //@TODO move motor thread to high level file
 void motor_thread(void const * argument);
 
-//@TODO move cmd parsing to high level file
-void motor_parse_cmd(uint8_t* buffer, int len);
-
 #endif //__LOW_LEVEL_H
@@ -0,0 +1,181 @@
+
+#include <nvm.h>
+
+#include <string.h>
+#include <stm32f4xx_hal.h>
+
+// Record layout (32bit words):
+//  [0] NVM_RECORD_MAGIC
+//  [1] sequence number, incremented on every save
+//  [2] version << 16 | payload size [bytes]
+//  [3...] payload, padded to a whole number of words
+//  [last] CRC32 over words 1 to last-1
+#define NVM_RECORD_MAGIC 0x4E564D31 // "NVM1"
+#define NVM_HEADER_WORDS 3
+#define NVM_ERASED_WORD 0xFFFFFFFF
+#define NVM_SECTOR_SIZE 0x20000 // [bytes]
+
+typedef struct {
+    uint32_t base;
+    uint32_t sector;
+} Nvm_sector_t;
+
+static const Nvm_sector_t nvm_sectors[] = {
+    {0x080C0000, FLASH_SECTOR_10},
+    {0x080E0000, FLASH_SECTOR_11},
+};
+static const int num_nvm_sectors = sizeof(nvm_sectors)/sizeof(nvm_sectors[0]);
+
+typedef struct {
+    const uint32_t* record; // newest valid record, NULL if there is none
+    int record_sector;
+    uint32_t seq;
+    const uint32_t* free[sizeof(nvm_sectors)/sizeof(nvm_sectors[0])]; // start of unwritten space, NULL if sector is unusable
+} Nvm_scan_t;
+
+static const uint32_t* sector_start(int sector) {
+    return (const uint32_t*)nvm_sectors[sector].base;
+}
+
+static const uint32_t* sector_end(int sector) {
+    return (const uint32_t*)(nvm_sectors[sector].base + NVM_SECTOR_SIZE);
+}
+
+static size_t record_words(size_t size) {
+    return NVM_HEADER_WORDS + (size + 3) / 4 + 1;
+}
+
+static uint32_t crc32(const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= bytes[i];
+        for (int b = 0; b < 8; ++b)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void scan_sector(int sector, Nvm_scan_t* scan) {
+    const uint32_t* p = sector_start(sector);
+    const uint32_t* end = sector_end(sector);
+    scan->free[sector] = NULL;
+
+    while (end - p >= (ptrdiff_t)record_words(0)) {
+        if (p[0] == NVM_ERASED_WORD) {
+            scan->free[sector] = p;
+            return;
+        }
+        // Anything else than a complete header means an interrupted write,
+        // we can't tell where the next record starts, so the sector is considered full.
+        size_t size = p[2] & 0xFFFF;
+        size_t words = record_words(size);
+        if (p[0] != NVM_RECORD_MAGIC || size > NVM_MAX_DATA_SIZE || (ptrdiff_t)words > end - p)
+            return;
+
+        bool crc_ok = crc32(&p[1], (words - 2) * 4) == p[words - 1];
+        if (crc_ok && (!scan->record || p[1] > scan->seq)) {
+            scan->record = p;
+            scan->record_sector = sector;
+            scan->seq = p[1];
+        }
+        p += words;
+    }
+}
+
+static void scan_sectors(Nvm_scan_t* scan) {
+    scan->record = NULL;
+    scan->record_sector = 0;
+    scan->seq = 0;
+    for (int i = 0; i < num_nvm_sectors; ++i)
+        scan_sector(i, scan);
+}
+
+static bool is_erased(const uint32_t* p, size_t words) {
+    for (size_t i = 0; i < words; ++i) {
+        if (p[i] != NVM_ERASED_WORD)
+            return false;
+    }
+    return true;
+}
+
+// Flash must be unlocked
+static bool erase_sector(int sector) {
+    FLASH_EraseInitTypeDef erase_init = {
+        .TypeErase = FLASH_TYPEERASE_SECTORS,
+        .Sector = nvm_sectors[sector].sector,
+        .NbSectors = 1,
+        .VoltageRange = FLASH_VOLTAGE_RANGE_3
+    };
+    uint32_t sector_error;
+    return HAL_FLASHEx_Erase(&erase_init, &sector_error) == HAL_OK
+        && sector_error == 0xFFFFFFFF;
+}
+
+// Flash must be unlocked
+static bool program_word(const uint32_t* dst, uint32_t value) {
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)dst, value) != HAL_OK)
+        return false;
+    return *dst == value;
+}
+
+bool nvm_load(void* data, size_t size, uint16_t version) {
+    Nvm_scan_t scan;
+    scan_sectors(&scan);
+    if (!scan.record)
+        return false;
+    if (scan.record[2] != (((uint32_t)version << 16) | size))
+        return false;
+    memcpy(data, &scan.record[NVM_HEADER_WORDS], size);
+    return true;
+}
+
+bool nvm_save(const void* data, size_t size, uint16_t version) {
+    if (size > NVM_MAX_DATA_SIZE)
+        return false;
+
+    // Assemble record in RAM
+    static uint32_t record[NVM_HEADER_WORDS + (NVM_MAX_DATA_SIZE + 3) / 4 + 1];
+    size_t words = record_words(size);
+    Nvm_scan_t scan;
+    scan_sectors(&scan);
+    memset(record, 0, sizeof(record));
+    record[0] = NVM_RECORD_MAGIC;
+    record[1] = scan.record ? scan.seq + 1 : 0;
+    record[2] = ((uint32_t)version << 16) | size;
+    memcpy(&record[NVM_HEADER_WORDS], data, size);
+    record[words - 1] = crc32(&record[1], (words - 2) * 4);
+
+    // Append to the active sector if it fits, otherwise move on to the next sector
+    int sector = scan.record ? scan.record_sector : 0;
+    const uint32_t* dst = scan.free[sector];
+    bool need_erase = false;
+    if (!dst || sector_end(sector) - dst < (ptrdiff_t)words || !is_erased(dst, words)) {
+        sector = (sector + 1) % num_nvm_sectors;
+        dst = sector_start(sector);
+        need_erase = true;
+    }
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+                           FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+    bool success = true;
+    if (need_erase)
+        success = erase_sector(sector);
+    for (size_t i = 0; success && i < words; ++i)
+        success = program_word(&dst[i], record[i]);
+    HAL_FLASH_Lock();
+
+    return success;
+}
+
+bool nvm_erase(void) {
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+                           FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+    bool success = true;
+    for (int i = 0; success && i < num_nvm_sectors; ++i)
+        success = erase_sector(i);
+    HAL_FLASH_Lock();
+    return success;
+}
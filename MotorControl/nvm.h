@@ -0,0 +1,32 @@
+
+#ifndef __NVM_H
+#define __NVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Non-volatile storage of a single configuration blob in internal flash.
+// Sectors 10 and 11 (2x 128kB at the top of flash) are reserved for this,
+// see STM32F405RGTx_FLASH.ld.
+// Every save appends a new record (header, payload, CRC32) to the active sector,
+// so a sector is only erased once every few hundred saves. When the active sector
+// is full, the other one is erased and becomes the active sector. The previous
+// record is only lost once the new one has been completely written.
+
+// Maximum payload size of a record [bytes]
+#define NVM_MAX_DATA_SIZE 1024
+
+// Loads the newest valid record into data.
+// Returns false if there is no valid record, or if the newest record
+// has a different version or size than requested.
+bool nvm_load(void* data, size_t size, uint16_t version);
+
+// Appends a new record. Stalls the CPU while flash is programmed/erased,
+// which can take up to a couple of seconds, so don't call while the motors are running.
+bool nvm_save(const void* data, size_t size, uint16_t version);
+
+// Erases both sectors
+bool nvm_erase(void);
+
+#endif //__NVM_H
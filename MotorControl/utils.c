@@ -1,8 +1,13 @@
 
 #include <utils.h>
 
+#include <math.h>
+#include <float.h>
+
 static const float one_by_sqrt3 = 0.57735026919f;
 static const float two_by_sqrt3 = 1.15470053838f;
+static const float pi = 3.14159265358979f;
+static const float pi_by_2 = 1.57079632679f;
 
 int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
     int Sextant;
@@ -130,3 +135,61 @@ int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
     ) retval = -1;
     return retval;
 }
+
+float svm_hex_norm(float alpha, float beta) {
+    // The hexagon edges are sqrt(3)/2 from the origin with normals at 30, 90 and 150 deg.
+    // The largest projection onto these normals, relative to sqrt(3)/2, is the t1 + t2 of SVM.
+    float abs_alpha = fabsf(alpha);
+    float abs_beta = fabsf(beta);
+    float norm_side = abs_alpha + one_by_sqrt3 * abs_beta;
+    float norm_top = two_by_sqrt3 * abs_beta;
+    return norm_side > norm_top ? norm_side : norm_top;
+}
+
+float wrap_pm_pi(float theta) {
+    while (theta >= pi) theta -= 2.0f * pi;
+    while (theta < -pi) theta += 2.0f * pi;
+    return theta;
+}
+
+float fast_atan2(float y, float x) {
+    float abs_y = fabsf(y);
+    float abs_x = fabsf(x);
+    // Reduce to the first octant, FLT_MIN avoids division by zero
+    float a = fminf(abs_x, abs_y) / (fmaxf(abs_x, abs_y) + FLT_MIN);
+    float s = a * a;
+    // Minimax polynomial for atan on [0, 1]
+    float r = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+    // Undo octant reduction
+    if (abs_y > abs_x) r = pi_by_2 - r;
+    if (x < 0.0f) r = pi - r;
+    if (y < 0.0f) r = -r;
+    return r;
+}
+
+void running_stats_reset(Running_stats_t* stats) {
+    stats->n = 0;
+    stats->mean = 0.0f;
+    stats->m2 = 0.0f;
+}
+
+void running_stats_update(Running_stats_t* stats, float x) {
+    stats->n++;
+    float delta = x - stats->mean;
+    stats->mean += delta / (float)stats->n;
+    stats->m2 += delta * (x - stats->mean);
+}
+
+float running_stats_var_of_mean(const Running_stats_t* stats) {
+    float n = (float)stats->n;
+    return stats->m2 / ((n - 1.0f) * n);
+}
+
+// -ffast-math would simplify (t - sum) - y to zero, which defeats the compensation
+__attribute__((optimize("no-fast-math")))
+void kahan_sum_add(Kahan_sum_t* acc, float x) {
+    float y = x - acc->compensation;
+    float t = acc->sum + y;
+    acc->compensation = (t - acc->sum) - y;
+    acc->sum = t;
+}
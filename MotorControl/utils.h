@@ -4,8 +4,41 @@
 
 // Compute rising edge timings (0.0 - 1.0) as a function of alpha-beta
 // as per the magnitude invariant clarke transform
-// The magnitude of the alpha-beta vector may not be larger than sqrt(3)/2
+// The alpha-beta vector must lie within the SVM hexagon, i.e. svm_hex_norm <= 1.
+// Up to a magnitude of sqrt(3)/2 (the inscribed circle) this holds in every direction.
 // Returns 0 on success, and -1 if the input was out of range
 int SVM(float alpha, float beta, float* tA, float* tB, float* tC);
 
+// Size of the alpha-beta vector relative to the SVM hexagon boundary in its direction.
+// 1 on the boundary: magnitude sqrt(3)/2 towards an edge, 1 towards a vertex (e.g. along alpha).
+// Dividing a vector by its norm scales it onto the hexagon without changing its angle.
+float svm_hex_norm(float alpha, float beta);
+
+// Wraps an angle to [-pi, pi)
+float wrap_pm_pi(float theta);
+
+// Approximation of atan2f, max error about 2e-4 rad
+float fast_atan2(float y, float x);
+
+// Running mean and variance (Welford's algorithm)
+typedef struct {
+    int n;
+    float mean;
+    float m2; // sum of squared deviations from the mean
+} Running_stats_t;
+
+void running_stats_reset(Running_stats_t* stats);
+void running_stats_update(Running_stats_t* stats, float x);
+// Variance of the estimated mean, i.e. sample variance / n
+// Only valid for n >= 2
+float running_stats_var_of_mean(const Running_stats_t* stats);
+
+// Compensated (Kahan) summation, so small increments don't get lost once the float sum is large
+typedef struct {
+    float sum;
+    float compensation; // low order bits that did not fit into sum
+} Kahan_sum_t;
+
+void kahan_sum_add(Kahan_sum_t* acc, float x);
+
 #endif //__UTILS_H
@@ -54,6 +54,9 @@
 /* USER CODE BEGIN Includes */     
 #include "freertos_vars.h"
 #include "low_level.h"
+#include "can_protocol.h"
+#include "commands.h"
+#include "usbd_cdc_if.h"
 #include "version.h"
 /* USER CODE END Includes */
 
@@ -133,6 +136,12 @@ void StartDefaultTask(void const * argument)
   // Start USB command handling thread
   osThreadDef(task_usb_cmd, usb_cmd_thread, osPriorityNormal, 0, 512);
   thread_usb_cmd = osThreadCreate(osThread(task_usb_cmd), NULL);
+  // Start CAN command and telemetry thread
+  osThreadDef(task_can, can_thread, osPriorityNormal, 0, 512);
+  thread_can = osThreadCreate(osThread(task_can), NULL);
+  // Start variable change notifications, below the USB thread so it can't interrupt a USB transfer setup
+  osThreadDef(task_subscriptions, subscription_thread, osPriorityBelowNormal, 0, 512);
+  thread_subscriptions = osThreadCreate(osThread(task_subscriptions), NULL);
 
   //If we get to here, then the default task is done.
   vTaskDelete(defaultTaskHandle);
@@ -152,6 +161,8 @@ void usb_cmd_thread(void const * argument) {
     //while(HAL_NVIC_GetActive(OTG_FS_IRQn)) {
       HAL_PCD_IRQHandler(&hpcd_USB_OTG_FS);
     //}
+    // Send what was queued while the previous transfer was in flight
+    usb_tx_kick();
     // Let the irq (OTG_FS_IRQHandler) fire again.
     HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
   }
@@ -50,6 +50,7 @@
 #include "stm32f4xx_hal.h"
 #include "cmsis_os.h"
 #include "adc.h"
+#include "dma.h"
 #include "can.h"
 #include "spi.h"
 #include "tim.h"
@@ -105,6 +106,7 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_ADC1_Init();
   MX_ADC2_Init();
   MX_CAN1_Init();
@@ -122,6 +124,10 @@ int main(void)
   OC4_PWM_Override(&htim1);
   OC4_PWM_Override(&htim8);
 
+  //Timestamping of encoder edges. ITR1 of TIM5 is TIM3, ITR0 of TIM12 is TIM4.
+  Encoder_Edge_Timer_Init(&htim5, TIM5, TIM_TS_ITR1);
+  Encoder_Edge_Timer_Init(&htim12, TIM12, TIM_TS_ITR0);
+
   /* USER CODE END 2 */
 
   /* Call init function for freertos objects (in freertos.c) */
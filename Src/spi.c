@@ -57,6 +57,8 @@
 /* USER CODE END 0 */
 
 SPI_HandleTypeDef hspi3;
+DMA_HandleTypeDef hdma_spi3_rx;
+DMA_HandleTypeDef hdma_spi3_tx;
 
 /* SPI3 init function */
 void MX_SPI3_Init(void)
@@ -105,6 +107,43 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
     GPIO_InitStruct.Alternate = GPIO_AF6_SPI3;
     HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
 
+    /* SPI3 DMA Init */
+    /* SPI3_RX Init */
+    hdma_spi3_rx.Instance = DMA1_Stream0;
+    hdma_spi3_rx.Init.Channel = DMA_CHANNEL_0;
+    hdma_spi3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_spi3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_spi3_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_spi3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    hdma_spi3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    hdma_spi3_rx.Init.Mode = DMA_NORMAL;
+    hdma_spi3_rx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_spi3_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_spi3_rx) != HAL_OK)
+    {
+      _Error_Handler(__FILE__, __LINE__);
+    }
+
+    __HAL_LINKDMA(spiHandle,hdmarx,hdma_spi3_rx);
+
+    /* SPI3_TX Init */
+    hdma_spi3_tx.Instance = DMA1_Stream5;
+    hdma_spi3_tx.Init.Channel = DMA_CHANNEL_0;
+    hdma_spi3_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_spi3_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_spi3_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_spi3_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    hdma_spi3_tx.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    hdma_spi3_tx.Init.Mode = DMA_NORMAL;
+    hdma_spi3_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_spi3_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_spi3_tx) != HAL_OK)
+    {
+      _Error_Handler(__FILE__, __LINE__);
+    }
+
+    __HAL_LINKDMA(spiHandle,hdmatx,hdma_spi3_tx);
+
   /* USER CODE BEGIN SPI3_MspInit 1 */
 
   /* USER CODE END SPI3_MspInit 1 */
@@ -129,6 +168,9 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* spiHandle)
     */
     HAL_GPIO_DeInit(GPIOC, GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12);
 
+    /* SPI3 DMA DeInit */
+    HAL_DMA_DeInit(spiHandle->hdmarx);
+    HAL_DMA_DeInit(spiHandle->hdmatx);
   /* USER CODE BEGIN SPI3_MspDeInit 1 */
 
   /* USER CODE END SPI3_MspDeInit 1 */
@@ -137,6 +179,95 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* spiHandle)
 
 /* USER CODE BEGIN 1 */
 
+// SPI3 transfer queue, shared by both gate drivers.
+// Transfers run back to back from the DMA complete interrupt. Each transfer gets its own chip select pulse.
+static SPI3_Transfer_t* spi3_queue_head = NULL; // in progress
+static SPI3_Transfer_t* spi3_queue_tail = NULL;
+
+// Minimum chip select high time between transfers, at least 1us at 168MHz
+static void SPI3_CS_Delay(void) {
+  for (volatile int i = 0; i < 64; ++i);
+}
+
+// Interrupts must be disabled
+static void SPI3_Start_Head(void) {
+  SPI3_Transfer_t* transfer = spi3_queue_head;
+  SPI3_CS_Delay();
+  HAL_GPIO_WritePin(transfer->nCS_port, transfer->nCS_pin, GPIO_PIN_RESET);
+  if (HAL_SPI_TransmitReceive_DMA(&hspi3, (uint8_t*)transfer->tx_buf, (uint8_t*)transfer->rx_buf, transfer->length) != HAL_OK)
+    HAL_SPI_ErrorCallback(&hspi3);
+}
+
+// Removes the transfer at the head of the queue and reports its result.
+// Interrupts must be disabled.
+static void SPI3_Pop_Head(bool success) {
+  SPI3_Transfer_t* transfer = spi3_queue_head;
+  HAL_GPIO_WritePin(transfer->nCS_port, transfer->nCS_pin, GPIO_PIN_SET);
+  spi3_queue_head = transfer->next;
+  if (!spi3_queue_head)
+    spi3_queue_tail = NULL;
+  transfer->success = success;
+  transfer->done = true;
+  if (transfer->on_complete)
+    transfer->on_complete(transfer);
+}
+
+// Finishes the transfer in progress and starts the next one
+static void SPI3_Complete_Head(bool success) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (spi3_queue_head) {
+    SPI3_Pop_Head(success);
+    if (spi3_queue_head)
+      SPI3_Start_Head();
+  }
+  __set_PRIMASK(primask);
+}
+
+void SPI3_Queue_Transfer(SPI3_Transfer_t* transfer) {
+  transfer->next = NULL;
+  transfer->done = false;
+  transfer->success = false;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (spi3_queue_tail) {
+    spi3_queue_tail->next = transfer;
+    spi3_queue_tail = transfer;
+  } else {
+    spi3_queue_head = spi3_queue_tail = transfer;
+    SPI3_Start_Head();
+  }
+  __set_PRIMASK(primask);
+}
+
+bool SPI3_Wait_Transfer(SPI3_Transfer_t* transfer, uint32_t timeout) {
+  uint32_t start = HAL_GetTick();
+  while (!transfer->done) {
+    if (HAL_GetTick() - start > timeout) {
+      // The bus is stuck, fail everything so no queued transfer outlives its buffers
+      uint32_t primask = __get_PRIMASK();
+      __disable_irq();
+      HAL_SPI_Abort(&hspi3);
+      while (spi3_queue_head)
+        SPI3_Pop_Head(false);
+      __set_PRIMASK(primask);
+      return false;
+    }
+  }
+  return transfer->success;
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+  if (hspi == &hspi3)
+    SPI3_Complete_Head(true);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+  if (hspi == &hspi3)
+    SPI3_Complete_Head(false);
+}
+
 /* USER CODE END 1 */
 
 /**
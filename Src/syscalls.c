@@ -16,9 +16,9 @@
 
 int _write(int file, char *data, int len) {
 
-  // transmit over CDC
-  uint8_t status = CDC_Transmit_FS((uint8_t*)data, len);
+  // queue for transmission over CDC
+  bool queued = usb_tx_queue((uint8_t*)data, len);
 
   // return number of bytes written
-  return (status == USBD_OK ? len : 0);
+  return (queued ? len : 0);
 }
@@ -232,7 +232,7 @@ void MX_TIM3_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
-  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_OC1;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim3, &sMasterConfig) != HAL_OK)
   {
@@ -265,7 +265,7 @@ void MX_TIM4_Init(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
-  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_OC1;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim4, &sMasterConfig) != HAL_OK)
   {
@@ -614,6 +614,95 @@ void HAL_TIM_Encoder_MspDeInit(TIM_HandleTypeDef* tim_encoderHandle)
 
 /* USER CODE BEGIN 1 */
 
+TIM_HandleTypeDef htim5;
+TIM_HandleTypeDef htim12;
+TIM_HandleTypeDef htim9;
+
+// Sets up a free running timer that timestamps the rising edges of an encoder A channel.
+// The encoder timer pulses its TRGO on every CC1 capture (MasterOutputTrigger = TIM_TRGO_OC1
+// in MX_TIM3_Init and MX_TIM4_Init), which this timer captures on channel 1 through TRC.
+// The CCR1 of the encoder timer holds the count at the same edge.
+void Encoder_Edge_Timer_Init(TIM_HandleTypeDef* htim, TIM_TypeDef* instance, uint32_t input_trigger) {
+  TIM_SlaveConfigTypeDef sSlaveConfig = {0};
+  TIM_IC_InitTypeDef sConfigIC;
+
+  htim->Instance = instance;
+  htim->Init.Prescaler = 0;
+  htim->Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim->Init.Period = 0xffff;
+  htim->Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  if (HAL_TIM_IC_Init(htim) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  // Only select the trigger input, the counter keeps running freely
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_DISABLE;
+  sSlaveConfig.InputTrigger = input_trigger;
+  if (HAL_TIM_SlaveConfigSynchronization(htim, &sSlaveConfig) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_RISING;
+  sConfigIC.ICSelection = TIM_ICSELECTION_TRC;
+  sConfigIC.ICPrescaler = TIM_ICPSC_DIV1;
+  sConfigIC.ICFilter = 0;
+  if (HAL_TIM_IC_ConfigChannel(htim, &sConfigIC, TIM_CHANNEL_1) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+}
+
+// Sets up TIM9 to count the rising edges of GPIO_4 (PA3, TIM9_CH2), it is clocked by the
+// step input itself. The input filter passes pulses of 8 timer clocks (48ns) and longer.
+void Step_Counter_Timer_Init(void) {
+  TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+  GPIO_InitTypeDef GPIO_InitStruct;
+
+  __HAL_RCC_TIM9_CLK_ENABLE();
+
+  htim9.Instance = TIM9;
+  htim9.Init.Prescaler = 0;
+  htim9.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim9.Init.Period = 0xffff;
+  htim9.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  if (HAL_TIM_Base_Init(&htim9) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_TI2;
+  sClockSourceConfig.ClockPolarity = TIM_CLOCKPOLARITY_RISING;
+  sClockSourceConfig.ClockFilter = 3;
+  if (HAL_TIM_ConfigClockSource(&htim9, &sClockSourceConfig) != HAL_OK)
+  {
+    _Error_Handler(__FILE__, __LINE__);
+  }
+
+  /**TIM9 GPIO Configuration
+  PA3     ------> TIM9_CH2
+  */
+  GPIO_InitStruct.Pin = GPIO_4_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF3_TIM9;
+  HAL_GPIO_Init(GPIO_4_GPIO_Port, &GPIO_InitStruct);
+}
+
+void HAL_TIM_IC_MspInit(TIM_HandleTypeDef* tim_icHandle)
+{
+  if(tim_icHandle->Instance==TIM5)
+  {
+    __HAL_RCC_TIM5_CLK_ENABLE();
+  }
+  else if(tim_icHandle->Instance==TIM12)
+  {
+    __HAL_RCC_TIM12_CLK_ENABLE();
+  }
+}
+
 /* USER CODE END 1 */
 
 /**
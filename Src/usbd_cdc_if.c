@@ -49,7 +49,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_cdc_if.h"
 /* USER CODE BEGIN INCLUDE */
-#include "low_level.h"
+#include "commands.h"
 /* USER CODE END INCLUDE */
 
 /** @addtogroup STM32_USB_OTG_DEVICE_LIBRARY
@@ -78,6 +78,8 @@
 /* It's up to user to redefine and/or remove those define */
 #define APP_RX_DATA_SIZE  64
 #define APP_TX_DATA_SIZE  64
+// Queue of data waiting for the IN endpoint, see usb_tx_queue. Power of two.
+#define USB_TX_QUEUE_SIZE 1024
 /* USER CODE END PRIVATE_DEFINES */
 /**
   * @}
@@ -105,6 +107,12 @@ uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
 uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+static uint8_t usb_tx_buffer[USB_TX_QUEUE_SIZE];
+// Free running byte counters, the buffer index is the counter modulo the size.
+// Bytes from tail on are in flight or waiting, tail only passes them once the transfer completed.
+static uint32_t usb_tx_head = 0;
+static uint32_t usb_tx_tail = 0;
+static uint32_t usb_tx_in_flight = 0;
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -306,6 +314,43 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+
+// Starts the next transfer if the previous one completed. Called after queueing and after
+// each USB interrupt, since the transfer complete (DataIn) event only clears TxState.
+void usb_tx_kick(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if (hcdc != NULL && hcdc->TxState == 0) {
+    usb_tx_tail += usb_tx_in_flight;
+    usb_tx_in_flight = 0;
+    uint32_t start = usb_tx_tail % USB_TX_QUEUE_SIZE;
+    uint32_t len = usb_tx_head - usb_tx_tail;
+    // Only up to the end of the buffer, the rest goes out with the next transfer
+    if (start + len > USB_TX_QUEUE_SIZE)
+      len = USB_TX_QUEUE_SIZE - start;
+    if (len > 0 && CDC_Transmit_FS(&usb_tx_buffer[start], len) == USBD_OK)
+      usb_tx_in_flight = len;
+  }
+  __set_PRIMASK(primask);
+}
+
+// Queues data for the IN endpoint, either all of it or, if the queue is full, nothing.
+// Unlike CDC_Transmit_FS it does not fail while a transfer is in flight, so replies and
+// notifications sent back to back are not lost. Callable from any thread.
+bool usb_tx_queue(const uint8_t* data, uint16_t len) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  bool queued = USB_TX_QUEUE_SIZE - (usb_tx_head - usb_tx_tail) >= len;
+  if (queued) {
+    for (uint16_t i = 0; i < len; ++i)
+      usb_tx_buffer[(usb_tx_head + i) % USB_TX_QUEUE_SIZE] = data[i];
+    usb_tx_head += len;
+  }
+  __set_PRIMASK(primask);
+  usb_tx_kick();
+  return queued;
+}
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
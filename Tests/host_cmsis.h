@@ -0,0 +1,16 @@
+// Host stand-ins for the Cortex-M intrinsics, so firmware sources build for the host.
+// Defining the include guard keeps the real cmsis_gcc.h (inline ARM assembly) out.
+#ifndef __HOST_CMSIS_H
+#define __HOST_CMSIS_H
+#include <stdint.h>
+#define __CMSIS_GCC_H
+extern uint32_t host_primask;
+static inline void __enable_irq(void) { host_primask = 0; }
+static inline void __disable_irq(void) { host_primask = 1; }
+static inline uint32_t __get_PRIMASK(void) { return host_primask; }
+static inline void __set_PRIMASK(uint32_t primask) { host_primask = primask; }
+static inline void __DSB(void) {}
+static inline void __ISB(void) {}
+static inline void __DMB(void) {}
+static inline void __NOP(void) {}
+#endif
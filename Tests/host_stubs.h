@@ -0,0 +1,36 @@
+// Stand-ins for what the firmware modules link from Src/ and the CMSIS DSP library.
+// Include once, in the test that includes or links MotorControl/low_level.c.
+#ifndef __HOST_STUBS_H
+#define __HOST_STUBS_H
+
+#include <math.h>
+#include <stm32f4xx_hal.h>
+
+uint32_t host_primask; // see host_cmsis.h
+
+// Peripheral handles (Src/adc.c, can.c, spi.c, tim.c), their registers are in RAM
+ADC_HandleTypeDef hadc1, hadc2, hadc3;
+CAN_HandleTypeDef hcan1;
+SPI_HandleTypeDef hspi3;
+TIM_HandleTypeDef htim1, htim2, htim3, htim4, htim5, htim8, htim9, htim12;
+
+static ADC_TypeDef host_adc_regs[3];
+static CAN_TypeDef host_can_regs;
+static SPI_TypeDef host_spi_regs;
+static TIM_TypeDef host_tim_regs[8];
+
+static void host_peripherals_init() {
+    ADC_HandleTypeDef* adcs[] = {&hadc1, &hadc2, &hadc3};
+    for (int i = 0; i < 3; ++i)
+        adcs[i]->Instance = &host_adc_regs[i];
+    hcan1.Instance = &host_can_regs;
+    hspi3.Instance = &host_spi_regs;
+    TIM_HandleTypeDef* tims[] = {&htim1, &htim2, &htim3, &htim4, &htim5, &htim8, &htim9, &htim12};
+    for (int i = 0; i < 8; ++i)
+        tims[i]->Instance = &host_tim_regs[i];
+}
+
+float arm_sin_f32(float x) { return sinf(x); }
+float arm_cos_f32(float x) { return cosf(x); }
+
+#endif //__HOST_STUBS_H
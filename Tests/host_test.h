@@ -0,0 +1,28 @@
+// Minimal checks for the host tests, see Makefile
+#ifndef __HOST_TEST_H
+#define __HOST_TEST_H
+
+#include <stdio.h>
+#include <math.h>
+
+static int test_failures = 0;
+
+// Counts and reports a failed condition, the test carries on
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        ++test_failures; \
+        printf("%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+#define CHECK_NEAR(a, b, tol) CHECK(fabsf((a) - (b)) <= (tol), "%s = %g, %s = %g", #a, (double)(a), #b, (double)(b))
+
+// Exit status of main
+static int test_result(const char* name) {
+    printf("%s: %s\n", name, test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
+
+#endif //__HOST_TEST_H
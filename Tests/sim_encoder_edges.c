@@ -0,0 +1,100 @@
+// Encoder PLL at crawl speeds, with and without the edge timestamp interpolation.
+// A simulated encoder turns at a constant speed. The encoder timer counts it, and the edge
+// timer captures the encoder A rising edges, as TIM3/TIM5 do. update_rotor runs once per
+// current measurement period, as in control_motor_loop. Without captures, interpolate_encoder_pos
+// returns the raw count, which is how the PLL worked before the edge timestamps.
+
+#include "../MotorControl/low_level.c"
+#include "host_stubs.h"
+#include "host_test.h"
+
+#define SETTLE_TIME 1.0 // [s] for the PLL to lock, not evaluated. Also at least 3 A edges.
+#define RUN_TIME 4.0 // [s]
+
+typedef struct {
+    double mean_error; // [counts/s]
+    double std_dev; // [counts/s] of pll_vel
+} Vel_stats_t;
+
+// Runs the rotor of M0 at vel [counts/s] and returns the statistics of pll_vel
+static Vel_stats_t simulate(double vel, bool edge_capture) {
+    Rotor_t* rotor = &motors[0].rotor;
+    TIM_TypeDef* enc_tim = rotor->encoder_timer->Instance;
+    TIM_TypeDef* edge_tim = rotor->edge_timer->Instance;
+    memset(enc_tim, 0, sizeof(*enc_tim));
+    memset(edge_tim, 0, sizeof(*edge_tim));
+    rotor->encoder_state = 0;
+    rotor->pll_pos = 0.0f;
+    rotor->pll_vel = (float)vel;
+    reset_encoder_edges(rotor);
+
+    // Start between two counts, away from an A edge
+    const double pos0 = 0.37;
+    double sum = 0.0, sum_sqr = 0.0;
+    int n = 0;
+    int last_edge = 0; // index of the last A rising edge, one every 4 counts
+    double settle_time = fmax(SETTLE_TIME, 12.0 / vel);
+    for (int k = 1; k * (double)current_meas_period < settle_time + RUN_TIME; ++k) {
+        double t = k * (double)current_meas_period;
+        double pos = pos0 + vel * t;
+        enc_tim->CNT = (uint16_t)(int32_t)floor(pos);
+        edge_tim->CNT = (uint16_t)(uint64_t)(t * TIM_APB1_CLOCK_HZ);
+        int edge = (int)floor(pos / 4.0);
+        if (edge_capture && edge != last_edge) {
+            // Captured at the most recent edge, an overcapture keeps the newest
+            double t_edge = (4.0 * edge - pos0) / vel;
+            edge_tim->CCR1 = (uint16_t)(uint64_t)(t_edge * TIM_APB1_CLOCK_HZ);
+            enc_tim->CCR1 = (uint16_t)(4 * edge);
+            edge_tim->SR |= TIM_SR_CC1IF;
+        }
+        last_edge = edge;
+
+        update_rotor(rotor);
+        // Reading CCR1 clears the capture flag on the hardware
+        edge_tim->SR &= ~TIM_SR_CC1IF;
+
+        if (t >= settle_time) {
+            double error = rotor->pll_vel - vel;
+            sum += error;
+            sum_sqr += error * error;
+            ++n;
+        }
+    }
+    Vel_stats_t stats;
+    stats.mean_error = sum / n;
+    stats.std_dev = sqrt(sum_sqr / n - stats.mean_error * stats.mean_error);
+    return stats;
+}
+
+int main() {
+    host_peripherals_init();
+    // As motor_calibration sets them: 1000rad/s bandwidth, critically damped
+    motors[0].rotor.pll_kp = 2000.0f;
+    motors[0].rotor.pll_ki = 0.25f * 2000.0f * 2000.0f;
+    static const double speeds[] = {2.0, 5.0, 10.0, 50.0, 200.0, 1000.0, 10000.0}; // [counts/s]
+    printf("pll_vel at %.0fHz, pll_kp %g, pll_ki %g\n", 1.0 / current_meas_period,
+            motors[0].rotor.pll_kp, motors[0].rotor.pll_ki);
+    printf("%12s %22s %22s %12s\n", "[counts/s]", "counts: mean, std dev", "edges: mean, std dev", "variance /");
+    for (unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); ++i) {
+        double vel = speeds[i];
+        Vel_stats_t counts = simulate(vel, false);
+        Vel_stats_t edges = simulate(vel, true);
+        double ratio = (counts.std_dev * counts.std_dev) / (edges.std_dev * edges.std_dev + 1e-12);
+        printf("%12.0f %10.3f %11.3f %10.3f %11.3f %12.3g\n", vel,
+                counts.mean_error, counts.std_dev, edges.mean_error, edges.std_dev, ratio);
+
+        // Unbiased either way, the interpolation must not trade variance for an offset
+        CHECK(fabs(edges.mean_error) < 0.01 * vel + 0.01, "vel %g mean error %g", vel, edges.mean_error);
+        if (vel < 4.0) {
+            // Less than one A edge (4 counts) per edge_timeout: the PLL falls back to the counts
+            CHECK(ratio > 0.9, "vel %g variance %g times worse", vel, 1.0 / ratio);
+        } else if (vel <= 1000.0) {
+            // Orders of magnitude better while the counts are far apart
+            CHECK(ratio > 1e4, "vel %g variance only improved %g times", vel, ratio);
+        } else {
+            // Never worse once there are many counts per period
+            CHECK(ratio > 1.0, "vel %g variance %g times worse", vel, 1.0 / ratio);
+        }
+    }
+    return test_result("sim_encoder_edges");
+}
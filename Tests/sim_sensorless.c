@@ -0,0 +1,204 @@
+// Sensorless mode on a simulated motor: the open loop spin up, the hand over to the flux
+// observer, and velocity control on the estimate. The motor is a surface PMSM with an inertia
+// and viscous friction, driven by an ideal inverter. osSignalWait advances it by one current
+// measurement period, as the ADC interrupt paces the motor thread.
+
+#include "../MotorControl/low_level.c"
+#include "host_stubs.h"
+#include "host_test.h"
+
+// Motor, as the firmware defaults assume: 7 pole pairs, kv 280
+#define R_PHASE 0.05 // [Ohm]
+#define L_PHASE 20e-6 // [H]
+#define FLUX_LINKAGE (5.51328895422 / (POLE_PAIRS * 280.0)) // [V / (rad/s)]
+#define INERTIA 1e-4 // [kg m^2]
+#define FRICTION 1e-5 // [Nm / (rad/s)]
+#define SUBSTEPS 20 // per period, the electrical time constant is 400us
+
+static const double two_pi = 6.28318530717959;
+
+typedef struct {
+    double i_alpha, i_beta; // [A]
+    double theta; // [rad] electrical, of the magnet d axis
+    double omega; // [rad/s] electrical
+    double v_alpha, v_beta; // [V] applied during the current period
+    double t; // [s]
+} Plant_t;
+
+static Plant_t plant;
+static Motor_t* const motor = &motors[0];
+// Called at each measurement, before the motor thread runs on it
+static void (*on_measurement)(void);
+static int num_measurements;
+
+static double wrap_pi(double x) {
+    x = fmod(x + M_PI, two_pi);
+    if (x < 0.0) x += two_pi;
+    return x - M_PI;
+}
+
+static void step_plant(double dt) {
+    double s = sin(plant.theta), c = cos(plant.theta);
+    // v = R i + L di/dt + omega * flux_linkage * [-sin, cos]
+    double di_alpha = (plant.v_alpha - R_PHASE * plant.i_alpha + plant.omega * FLUX_LINKAGE * s) / L_PHASE;
+    double di_beta = (plant.v_beta - R_PHASE * plant.i_beta - plant.omega * FLUX_LINKAGE * c) / L_PHASE;
+    double i_q = c * plant.i_beta - s * plant.i_alpha;
+    double torque = 1.5 * POLE_PAIRS * FLUX_LINKAGE * i_q;
+    double domega = POLE_PAIRS * (torque - FRICTION * plant.omega / POLE_PAIRS) / INERTIA;
+    plant.i_alpha += di_alpha * dt;
+    plant.i_beta += di_beta * dt;
+    plant.theta = wrap_pi(plant.theta + plant.omega * dt);
+    plant.omega += domega * dt;
+}
+
+osEvent osSignalWait(int32_t signals, uint32_t millisec) {
+    // The voltage queued in the last cycle is applied from the last measurement to this one
+    double dt = current_meas_period / SUBSTEPS;
+    for (int i = 0; i < SUBSTEPS; ++i)
+        step_plant(dt);
+    plant.t += current_meas_period;
+    plant.v_alpha = motor->current_control.final_v_alpha;
+    plant.v_beta = motor->current_control.final_v_beta;
+
+    // Inverse of the clarke transform in the firmware, phase A is not measured
+    motor->current_meas.phB = (float)(-0.5 * plant.i_alpha + 0.86602540378 * plant.i_beta);
+    motor->current_meas.phC = (float)(-0.5 * plant.i_alpha - 0.86602540378 * plant.i_beta);
+    ++num_measurements;
+    if (on_measurement)
+        on_measurement();
+
+    osEvent evt = {.status = osEventSignal};
+    evt.value.signals = signals;
+    return evt;
+}
+
+static void reset(double theta) {
+    memset(&plant, 0, sizeof(plant));
+    plant.theta = theta;
+    on_measurement = NULL;
+    num_measurements = 0;
+    motor->error = ERROR_NO_ERROR;
+    motor->enable_control = true;
+    motor->enable_step_dir = false;
+    motor->control_mode = CTRL_MODE_VELOCITY_CONTROL;
+    motor->vel_setpoint = 0.0f;
+    motor->vel_integrator_current = 0.0f;
+}
+
+// Speed of the rotor in the units of vel_setpoint
+static double plant_vel() {
+    return plant.omega / elec_rad_per_enc;
+}
+
+//--------------------------------
+// Spin up, then velocity control
+//--------------------------------
+
+#define SETPOINT_1 20000.0 // [counts/s] vel_limit
+#define SETPOINT_2 8000.0 // [counts/s]
+#define SETPOINT_TIME 1.0 // [s] at each setpoint
+#define EVAL_TIME 0.5 // [s] at the end of each setpoint
+
+static double control_start;
+static double max_phase_error; // [rad] after the spin up
+static double vel_sum[2], vel_err_sqr[2];
+static int vel_n[2];
+
+static void on_velocity_control() {
+    double t = plant.t - control_start;
+    // The estimate is of the last measurement, the currents of which the plant has just replaced
+    double phase_error = fabs(wrap_pi(motor->sensorless.phase - plant.theta + plant.omega * current_meas_period));
+    if (phase_error > max_phase_error)
+        max_phase_error = phase_error;
+
+    int setpoint = (t < SETPOINT_TIME) ? 0 : 1;
+    motor->vel_setpoint = (setpoint == 0) ? SETPOINT_1 : SETPOINT_2;
+    if (fmod(t, SETPOINT_TIME) >= SETPOINT_TIME - EVAL_TIME) {
+        double err = plant_vel() - motor->vel_setpoint;
+        vel_sum[setpoint] += err;
+        vel_err_sqr[setpoint] += err * err;
+        ++vel_n[setpoint];
+    }
+    if (t >= 2.0 * SETPOINT_TIME)
+        motor->enable_control = false;
+}
+
+static void test_velocity_control() {
+    // The magnet starts away from the phase of the ramp, the ramp current pulls it in
+    reset(1.0);
+    motor->vel_setpoint = SETPOINT_1;
+    bool spun_up = spin_up_sensorless(motor);
+    CHECK(spun_up, "spin up failed, error %d", motor->error);
+    double spin_up_error = fabs(motor->sensorless.pll_vel - plant.omega);
+    printf("spin up: %.2fs to %.0frad/s, estimate %.0frad/s\n", plant.t, plant.omega, motor->sensorless.pll_vel);
+    CHECK(spin_up_error < 0.05 * motor->sensorless.spin_up_target_vel, "spin up vel error %g rad/s", spin_up_error);
+    if (!spun_up)
+        return;
+
+    control_start = plant.t;
+    max_phase_error = 0.0;
+    on_measurement = on_velocity_control;
+    control_motor_loop(motor);
+    CHECK(motor->error == ERROR_NO_ERROR, "velocity control stopped with error %d", motor->error);
+
+    printf("velocity control: max observer phase error %.3frad\n", max_phase_error);
+    CHECK(max_phase_error < 0.15, "observer phase error %g rad", max_phase_error);
+    const double setpoints[2] = {SETPOINT_1, SETPOINT_2};
+    for (int i = 0; i < 2; ++i) {
+        double mean = vel_sum[i] / vel_n[i];
+        double std_dev = sqrt(vel_err_sqr[i] / vel_n[i] - mean * mean);
+        printf("  at %.0fcounts/s: mean error %.1fcounts/s, std dev %.1fcounts/s\n", setpoints[i], mean, std_dev);
+        CHECK(fabs(mean) < 0.01 * setpoints[i], "setpoint %g mean error %g", setpoints[i], mean);
+        CHECK(std_dev < 0.01 * setpoints[i], "setpoint %g std dev %g", setpoints[i], std_dev);
+    }
+}
+
+//--------------------------------
+// No position control
+//--------------------------------
+
+static void test_position_control_rejected() {
+    // Not even spun up
+    reset(0.0);
+    motor->control_mode = CTRL_MODE_POSITION_CONTROL;
+    CHECK(!spin_up_sensorless(motor), "spin up in position control");
+    CHECK(motor->error == ERROR_SENSORLESS_POSITION_CONTROL, "error %d", motor->error);
+    CHECK(num_measurements == 0, "%d periods of spin up", num_measurements);
+}
+
+static int mode_change_measurement;
+
+static void on_mode_change() {
+    if (num_measurements == mode_change_measurement)
+        motor->control_mode = CTRL_MODE_POSITION_CONTROL;
+    if (num_measurements > mode_change_measurement + 1)
+        motor->enable_control = false; // not stopped, don't loop forever
+}
+
+static void test_position_control_stops() {
+    // Changed while running: the control loop stops on the next measurement, at the latest
+    reset(0.0);
+    CHECK(spin_up_sensorless(motor), "spin up failed, error %d", motor->error);
+    mode_change_measurement = num_measurements + 100;
+    on_measurement = on_mode_change;
+    control_motor_loop(motor);
+    CHECK(motor->error == ERROR_SENSORLESS_POSITION_CONTROL, "error %d", motor->error);
+    CHECK(num_measurements == mode_change_measurement, "stopped %d periods after the change",
+            num_measurements - mode_change_measurement);
+}
+
+int main() {
+    host_peripherals_init();
+    // As motor_calibration measures and sets them
+    motor->sensorless_mode = true;
+    motor->phase_resistance = (float)R_PHASE;
+    motor->phase_inductance = (float)L_PHASE;
+    motor->current_control.p_gain = motor->current_control.bandwidth * motor->phase_inductance;
+    motor->current_control.i_gain = (motor->phase_resistance / motor->phase_inductance) * motor->current_control.p_gain;
+    motor->rotor.motor_dir = 1;
+
+    test_position_control_rejected();
+    test_velocity_control();
+    test_position_control_stops();
+    return test_result("sim_sensorless");
+}
@@ -0,0 +1,269 @@
+// The CAN protocol at message level, without a bus: the hardware filters as the bxCAN
+// applies them, frame decoding and dispatch into motors[], setpoints held for the SYNC,
+// and the encoding of the telemetry and PDO frames.
+
+#include "../MotorControl/can_protocol.c"
+#include "host_stubs.h"
+#include "host_test.h"
+
+// Filters passed to HAL_CAN_ConfigFilter by can_start
+static CAN_FilterConfTypeDef filters[2];
+static int num_filters;
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef* hcan, CAN_FilterConfTypeDef* config) {
+    if (num_filters < 2)
+        filters[num_filters++] = *config;
+    return HAL_OK;
+}
+
+// 32 bit mask mode, as the bxCAN compares a frame against a filter bank:
+// the identifier in the layout of the RIR register, STID at bit 21, IDE at bit 2, RTR at bit 1
+static bool filter_accepts(const CAN_FilterConfTypeDef* filter, uint32_t rir) {
+    uint32_t id = filter->FilterIdHigh << 16 | filter->FilterIdLow;
+    uint32_t mask = filter->FilterMaskIdHigh << 16 | filter->FilterMaskIdLow;
+    return ((rir ^ id) & mask) == 0;
+}
+
+static void start_node(int id) {
+    num_filters = 0;
+    can_node_id = id;
+    can_start();
+}
+
+static void test_filters() {
+    start_node(5);
+    CHECK(num_filters == 2, "%d filters", num_filters);
+    CHECK(filters[0].FilterFIFOAssignment == CAN_FILTER_FIFO0, "setpoints in FIFO %u", filters[0].FilterFIFOAssignment);
+    CHECK(filters[1].FilterFIFOAssignment == CAN_FILTER_FIFO1, "SYNC in FIFO %u", filters[1].FilterFIFOAssignment);
+    for (uint32_t stid = 0; stid < 0x800; ++stid) {
+        uint32_t rir = stid << 21;
+        bool own = (stid >> CAN_NODE_ID_SHIFT) == 5;
+        CHECK(filter_accepts(&filters[0], rir) == own, "id 0x%03x", stid);
+        CHECK(filter_accepts(&filters[1], rir) == (stid == CAN_SYNC_ID), "id 0x%03x", stid);
+        // Remote frames and extended identifiers with the same leading bits are rejected
+        CHECK(!filter_accepts(&filters[0], rir | CAN_RTR_REMOTE), "remote id 0x%03x", stid);
+        CHECK(!filter_accepts(&filters[0], rir | CAN_ID_EXT), "extended id 0x%03x", stid);
+        CHECK(!filter_accepts(&filters[1], rir | CAN_RTR_REMOTE), "remote id 0x%03x", stid);
+    }
+    CHECK((hcan1.Instance->IER & (CAN_IT_FMP0 | CAN_IT_FMP1 | CAN_IT_TME)) == (CAN_IT_FMP0 | CAN_IT_FMP1 | CAN_IT_TME),
+            "IER 0x%08x", (unsigned)hcan1.Instance->IER);
+
+    // The highest node ID, and an invalid one, which falls back to the lowest
+    start_node(CAN_NODE_ID_MAX);
+    CHECK(filter_accepts(&filters[0], (uint32_t)frame_id(1, CAN_MSG_SET_VEL) << 21), "node 63");
+    CHECK(frame_id(1, CAN_MSG_SET_VEL) == 0x7F2, "frame id 0x%03x", frame_id(1, CAN_MSG_SET_VEL));
+    start_node(0);
+    CHECK(node_id == CAN_NODE_ID_MIN, "node_id %d", node_id);
+    CHECK(!filter_accepts(&filters[0], 0x005u << 21), "node 0 broadcast passed the filter");
+}
+
+// Puts a frame into a receive FIFO and runs its interrupt handler
+static void receive(int fifo, uint16_t id, const void* data, uint8_t len) {
+    CAN_TypeDef* can = hcan1.Instance;
+    uint32_t words[2] = {0, 0};
+    memcpy(words, data, len);
+    can->sFIFOMailBox[fifo].RIR = (uint32_t)id << 21;
+    can->sFIFOMailBox[fifo].RDTR = len;
+    can->sFIFOMailBox[fifo].RDLR = words[0];
+    can->sFIFOMailBox[fifo].RDHR = words[1];
+    // One frame pending. The handler releases it, which clears the pending count here too.
+    if (fifo == 0) {
+        can->RF0R = 1;
+        can_rx_fifo0_cb();
+        CHECK(can->RF0R == CAN_RF0R_RFOM0, "FIFO 0 not released");
+    } else {
+        can->RF1R = 1;
+        can_rx_fifo1_cb();
+        CHECK(can->RF1R == CAN_RF1R_RFOM1, "FIFO 1 not released");
+    }
+}
+
+static void test_dispatch() {
+    start_node(3);
+    can_sync = false;
+
+    float pos[2] = {1234.5f, -50.0f};
+    receive(0, frame_id(0, CAN_MSG_SET_POS), pos, 8);
+    CHECK(motors[0].control_mode == CTRL_MODE_POSITION_CONTROL, "mode %d", motors[0].control_mode);
+    CHECK_NEAR(motors[0].pos_setpoint, 1234.5f, 0.0f);
+    CHECK_NEAR(motors[0].vel_setpoint, -50.0f, 0.0f);
+    CHECK_NEAR(motors[0].current_setpoint, 0.0f, 0.0f);
+
+    float vel[2] = {2000.0f, 1.5f};
+    receive(0, frame_id(1, CAN_MSG_SET_VEL), vel, 8);
+    CHECK(motors[1].control_mode == CTRL_MODE_VELOCITY_CONTROL, "mode %d", motors[1].control_mode);
+    CHECK_NEAR(motors[1].vel_setpoint, 2000.0f, 0.0f);
+    CHECK_NEAR(motors[1].current_setpoint, 1.5f, 0.0f);
+    // The other motor is left alone
+    CHECK(motors[0].control_mode == CTRL_MODE_POSITION_CONTROL, "mode %d", motors[0].control_mode);
+
+    float current = -3.25f;
+    receive(0, frame_id(0, CAN_MSG_SET_CURRENT), &current, 4);
+    CHECK(motors[0].control_mode == CTRL_MODE_CURRENT_CONTROL, "mode %d", motors[0].control_mode);
+    CHECK_NEAR(motors[0].current_setpoint, -3.25f, 0.0f);
+
+    // Too short, and frames the board only sends, are ignored
+    float ignored[2] = {99.0f, 99.0f};
+    receive(0, frame_id(0, CAN_MSG_SET_CURRENT), ignored, 3);
+    receive(0, frame_id(1, CAN_MSG_SET_POS), ignored, 7);
+    receive(0, frame_id(1, CAN_MSG_POS_VEL), ignored, 8);
+    receive(0, frame_id(1, CAN_MSG_STATUS), ignored, 8);
+    CHECK_NEAR(motors[0].current_setpoint, -3.25f, 0.0f);
+    CHECK(motors[1].control_mode == CTRL_MODE_VELOCITY_CONTROL, "mode %d", motors[1].control_mode);
+    CHECK_NEAR(motors[1].vel_setpoint, 2000.0f, 0.0f);
+}
+
+static void test_sync() {
+    start_node(3);
+    can_sync = true;
+    set_current_setpoint(&motors[0], 0.0f);
+    set_current_setpoint(&motors[1], 0.0f);
+
+    // Held until the SYNC, the newer setpoint of a motor replaces the older one
+    float vel[2] = {100.0f, 0.0f};
+    receive(0, frame_id(0, CAN_MSG_SET_VEL), vel, 8);
+    float pos[2] = {500.0f, 10.0f};
+    receive(0, frame_id(0, CAN_MSG_SET_POS), pos, 8);
+    float current = 2.0f;
+    receive(0, frame_id(1, CAN_MSG_SET_CURRENT), &current, 4);
+    CHECK(motors[0].control_mode == CTRL_MODE_CURRENT_CONTROL, "applied before the SYNC");
+    CHECK_NEAR(motors[1].current_setpoint, 0.0f, 0.0f);
+
+    receive(1, CAN_SYNC_ID, NULL, 0);
+    CHECK(motors[0].control_mode == CTRL_MODE_POSITION_CONTROL, "mode %d", motors[0].control_mode);
+    CHECK_NEAR(motors[0].pos_setpoint, 500.0f, 0.0f);
+    CHECK_NEAR(motors[0].vel_setpoint, 10.0f, 0.0f);
+    CHECK_NEAR(motors[1].current_setpoint, 2.0f, 0.0f);
+    CHECK(!sync_setpoints[0].pending && !sync_setpoints[1].pending, "setpoints still pending");
+
+    // Each setpoint is applied once
+    motors[0].pos_setpoint = 0.0f;
+    receive(1, CAN_SYNC_ID, NULL, 0);
+    CHECK_NEAR(motors[0].pos_setpoint, 0.0f, 0.0f);
+    can_sync = false;
+}
+
+// Takes the frame at the front of the transmit queue
+static Can_frame_t take_queued() {
+    Can_frame_t frame = tx_queue[tx_queue_head];
+    tx_queue_head = (tx_queue_head + 1) % CAN_TX_QUEUE_SIZE;
+    --tx_queue_count;
+    return frame;
+}
+
+static void test_telemetry() {
+    start_node(7);
+    CAN_TypeDef* can = hcan1.Instance;
+    can->TSR = 0; // all mailboxes busy, frames go to the queue
+    tx_queue_head = 0;
+    tx_queue_count = 0;
+
+    Motor_t* motor = &motors[1];
+    motor->error = ERROR_GATE_DRIVER_FAULT;
+    motor->control_mode = CTRL_MODE_VELOCITY_CONTROL;
+    motor->enable_control = true;
+    motor->calibration_ok = false;
+    motor->thread_ready = true;
+    motor->gate_driver_fault = GATE_DRIVER_FAULT_OTSD | GATE_DRIVER_FAULT_FETHA_OC;
+    motor->rotor.pll_pos = -8192.25f;
+    motor->rotor.pll_vel = 300.5f;
+    motor->rotor.motor_dir = -1;
+    motor->current_control.Iq_measured = 4.0f;
+    motor->current_control.Ibus = 1.25f;
+    send_telemetry(1);
+    CHECK(tx_queue_count == 3, "%d frames", tx_queue_count);
+
+    Can_frame_t status = take_queued();
+    CHECK(status.id == (7 << 5 | 1 << 4 | CAN_MSG_STATUS), "id 0x%03x", status.id);
+    CHECK(status.len == 8, "len %d", status.len);
+    int32_t error;
+    uint16_t fault;
+    memcpy(&error, &status.data[0], 4);
+    memcpy(&fault, &status.data[6], 2);
+    CHECK(error == ERROR_GATE_DRIVER_FAULT, "error %d", (int)error);
+    CHECK(status.data[4] == CTRL_MODE_VELOCITY_CONTROL, "mode %d", status.data[4]);
+    CHECK(status.data[5] == (1 | 4), "flags 0x%02x", status.data[5]);
+    CHECK(fault == (GATE_DRIVER_FAULT_OTSD | GATE_DRIVER_FAULT_FETHA_OC), "gate driver fault 0x%04x", fault);
+
+    Can_frame_t pos_vel = take_queued();
+    CHECK(pos_vel.id == (7 << 5 | 1 << 4 | CAN_MSG_POS_VEL), "id 0x%03x", pos_vel.id);
+    CHECK(pos_vel.len == 8, "len %d", pos_vel.len);
+    CHECK_NEAR(read_float(&pos_vel.data[0]), -8192.25f, 0.0f);
+    CHECK_NEAR(read_float(&pos_vel.data[4]), 300.5f, 0.0f);
+
+    // Iq is reported in the direction of the setpoints
+    Can_frame_t current = take_queued();
+    CHECK(current.id == (7 << 5 | 1 << 4 | CAN_MSG_CURRENT), "id 0x%03x", current.id);
+    CHECK_NEAR(read_float(&current.data[0]), -4.0f, 0.0f);
+    CHECK_NEAR(read_float(&current.data[4]), 1.25f, 0.0f);
+
+    // Into the mailbox that CODE points at
+    can->TSR = CAN_TSR_TME1 | (1u << 24);
+    CHECK(write_mailbox(&pos_vel), "mailbox 1 is free");
+    CHECK(can->sTxMailBox[1].TIR == ((uint32_t)pos_vel.id << 21 | CAN_TI0R_TXRQ), "TIR 0x%08x", (unsigned)can->sTxMailBox[1].TIR);
+    CHECK(can->sTxMailBox[1].TDTR == 8, "TDTR %u", (unsigned)can->sTxMailBox[1].TDTR);
+    uint32_t words[2] = {can->sTxMailBox[1].TDLR, can->sTxMailBox[1].TDHR};
+    CHECK(memcmp(words, pos_vel.data, 8) == 0, "payload");
+    can->TSR = 0;
+    CHECK(!write_mailbox(&pos_vel), "all mailboxes are busy");
+
+    // A full queue drops frames and counts them
+    int dropped = can_tx_dropped;
+    for (int i = 0; i < CAN_TX_QUEUE_SIZE + 2; ++i)
+        can_send(frame_id(0, CAN_MSG_STATUS), words, 8);
+    CHECK(tx_queue_count == CAN_TX_QUEUE_SIZE, "%d queued", tx_queue_count);
+    CHECK(can_tx_dropped == dropped + 2, "%d dropped", can_tx_dropped - dropped);
+    tx_queue_count = 0;
+}
+
+static void test_pdo() {
+    start_node(2);
+    can_telemetry_period = 10;
+    hcan1.Instance->TSR = 0;
+    tx_queue_head = 0;
+    tx_queue_count = 0;
+
+    // vbus_voltage is a float, motors[0].error an int, see vars[] in commands.c
+    uint16_t entries[3] = {0, 80, 80};
+    CHECK(!can_set_pdo(0, 5, false, entries, 3), "12 bytes accepted");
+    CHECK(!can_set_pdo(CAN_NUM_PDOS, 5, false, entries, 2), "PDO out of range accepted");
+    uint16_t unknown = 9999;
+    CHECK(!can_set_pdo(0, 5, false, &unknown, 1), "unknown variable accepted");
+    CHECK(can_set_pdo(0, 5, true, entries, 2), "2 variables refused");
+
+    vbus_voltage = 24.5f;
+    motors[0].error = ERROR_DC_BUS_OVERVOLTAGE;
+    send_pdo(0, 1000);
+    CHECK(tx_queue_count == 1, "%d frames", tx_queue_count);
+    Can_frame_t frame = take_queued();
+    CHECK(frame.id == (2 << 5 | (CAN_MSG_PDO + 0)), "id 0x%03x", frame.id);
+    CHECK(frame.len == 8, "len %d", frame.len);
+    int32_t error;
+    memcpy(&error, &frame.data[4], 4);
+    CHECK_NEAR(read_float(&frame.data[0]), 24.5f, 0.0f);
+    CHECK(error == ERROR_DC_BUS_OVERVOLTAGE, "error %d", (int)error);
+
+    // Not before the period, and on_change holds back an unchanged payload
+    send_pdo(0, 1004);
+    send_pdo(0, 1005);
+    CHECK(tx_queue_count == 0, "%d frames", tx_queue_count);
+    vbus_voltage = 24.0f;
+    send_pdo(0, 1010);
+    CHECK(tx_queue_count == 1, "%d frames", tx_queue_count);
+    take_queued();
+
+    // 2 motors * 3 frames of 135 bits every 10ms, and the 8 byte PDO every 5ms: 10.8%
+    CHECK_NEAR(can_bus_load_estimate(), 10.8f, 1e-3f);
+    can_set_pdo(0, 0, false, NULL, 0);
+    CHECK_NEAR(can_bus_load_estimate(), 8.1f, 1e-3f);
+}
+
+int main() {
+    host_peripherals_init();
+    test_filters();
+    test_dispatch();
+    test_sync();
+    test_telemetry();
+    test_pdo();
+    return test_result("test_can_protocol");
+}
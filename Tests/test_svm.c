@@ -0,0 +1,132 @@
+// SVM() and svm_hex_norm() over the whole alpha-beta plane: the timings produce the
+// requested vector, are continuous across the sextant boundaries and saturate exactly
+// at the hexagon, which svm_hex_norm describes.
+
+#include <utils.h>
+#include "host_test.h"
+
+static const float pi = 3.14159265358979f;
+static const float sqrt3_by_2 = 0.86602540378f;
+
+// Alpha-beta vector the timings produce. A phase is high from its rising edge t to the end of
+// the half period, so its duty is 1 - t. The magnitude invariant clarke transform of the duties
+// is in units of 2/3 of the bus voltage, the unit of the modulation index.
+static void timings_to_alpha_beta(float tA, float tB, float tC, float* alpha, float* beta) {
+    float dA = 1.0f - tA, dB = 1.0f - tB, dC = 1.0f - tC;
+    *alpha = dA - 0.5f * (dB + dC);
+    *beta = sqrt3_by_2 * (dB - dC);
+}
+
+// Magnitude of the hexagon boundary at an angle
+static float hex_radius(float theta) {
+    // Distance from the nearest edge normal, the normals are at 30 + k*60 deg
+    float from_normal = fmodf(theta - pi / 6.0f + 8.0f * pi, pi / 3.0f);
+    if (from_normal > pi / 6.0f) from_normal -= pi / 3.0f;
+    return sqrt3_by_2 / cosf(from_normal);
+}
+
+static void check_vector(float alpha, float beta) {
+    float tA, tB, tC;
+    int result = SVM(alpha, beta, &tA, &tB, &tC);
+    CHECK(result == 0, "SVM(%g, %g) returned %d", alpha, beta, result);
+    CHECK(tA >= 0.0f && tA <= 1.0f && tB >= 0.0f && tB <= 1.0f && tC >= 0.0f && tC <= 1.0f,
+            "SVM(%g, %g) timings %g %g %g", alpha, beta, tA, tB, tC);
+    float out_alpha, out_beta;
+    timings_to_alpha_beta(tA, tB, tC, &out_alpha, &out_beta);
+    CHECK_NEAR(out_alpha, alpha, 1e-5f);
+    CHECK_NEAR(out_beta, beta, 1e-5f);
+    // The zero vector time is split evenly between both ends of the period
+    float t_min = fminf(tA, fminf(tB, tC));
+    float t_max = fmaxf(tA, fmaxf(tB, tC));
+    CHECK_NEAR(t_min + t_max, 1.0f, 1e-5f);
+}
+
+static void test_full_range() {
+    // Every direction, from zero up to the hexagon boundary
+    for (int a = 0; a < 3600; ++a) {
+        float theta = 2.0f * pi * a / 3600.0f;
+        for (int m = 0; m <= 20; ++m) {
+            float mag = 0.9999f * hex_radius(theta) * m / 20.0f;
+            check_vector(mag * cosf(theta), mag * sinf(theta));
+        }
+    }
+}
+
+static void test_sextant_boundaries() {
+    // The sextants change at multiples of 60 deg, the quadrants SVM tests first at 90 deg.
+    // Just either side of a boundary the timings have to be the same.
+    const float eps = 1e-5f;
+    for (int k = 0; k < 12; ++k) {
+        float theta = k * pi / 6.0f;
+        for (int m = 1; m <= 4; ++m) {
+            float mag = 0.999f * hex_radius(theta) * m / 4.0f;
+            float t_lo[3], t_hi[3], t_on[3];
+            SVM(mag * cosf(theta - eps), mag * sinf(theta - eps), &t_lo[0], &t_lo[1], &t_lo[2]);
+            SVM(mag * cosf(theta + eps), mag * sinf(theta + eps), &t_hi[0], &t_hi[1], &t_hi[2]);
+            SVM(mag * cosf(theta), mag * sinf(theta), &t_on[0], &t_on[1], &t_on[2]);
+            for (int ph = 0; ph < 3; ++ph) {
+                CHECK_NEAR(t_lo[ph], t_hi[ph], 1e-4f);
+                CHECK_NEAR(t_on[ph], t_hi[ph], 1e-4f);
+            }
+            check_vector(mag * cosf(theta), mag * sinf(theta));
+        }
+    }
+    // The zero vector and exact axis directions, where the comparisons in SVM are equal
+    check_vector(0.0f, 0.0f);
+    check_vector(0.5f, 0.0f);
+    check_vector(-0.5f, 0.0f);
+    check_vector(0.0f, 0.5f);
+    check_vector(0.0f, -0.5f);
+    check_vector(-0.0f, -0.0f);
+}
+
+static void test_saturation() {
+    for (int a = 0; a < 3600; ++a) {
+        float theta = 2.0f * pi * a / 3600.0f;
+        float alpha = cosf(theta), beta = sinf(theta);
+        float norm = svm_hex_norm(alpha, beta);
+        CHECK_NEAR(1.0f / norm, hex_radius(theta), 1e-5f);
+
+        // Scaled onto the boundary: full modulation, one phase always low and one always high
+        float tA, tB, tC;
+        CHECK(SVM(0.9999f * alpha / norm, 0.9999f * beta / norm, &tA, &tB, &tC) == 0, "theta %g", theta);
+        float t_min = fminf(tA, fminf(tB, tC));
+        float t_max = fmaxf(tA, fmaxf(tB, tC));
+        CHECK_NEAR(t_max - t_min, 1.0f, 1e-3f);
+        // The direction is unchanged by the scaling
+        float out_alpha, out_beta;
+        timings_to_alpha_beta(tA, tB, tC, &out_alpha, &out_beta);
+        CHECK_NEAR(atan2f(out_beta, out_alpha), atan2f(beta, alpha), 1e-4f);
+
+        // Just outside it is out of range
+        CHECK(SVM(1.001f * alpha / norm, 1.001f * beta / norm, &tA, &tB, &tC) == -1, "theta %g", theta);
+    }
+}
+
+static void test_hex_norm() {
+    // Towards a vertex the boundary is at 1, towards an edge at sqrt(3)/2
+    CHECK_NEAR(svm_hex_norm(1.0f, 0.0f), 1.0f, 1e-6f);
+    CHECK_NEAR(svm_hex_norm(-1.0f, 0.0f), 1.0f, 1e-6f);
+    CHECK_NEAR(svm_hex_norm(0.5f, sqrt3_by_2), 1.0f, 1e-6f);
+    CHECK_NEAR(svm_hex_norm(0.0f, sqrt3_by_2), 1.0f, 1e-6f);
+    CHECK_NEAR(svm_hex_norm(0.0f, -sqrt3_by_2), 1.0f, 1e-6f);
+    CHECK_NEAR(svm_hex_norm(0.75f, 0.25f), svm_hex_norm(-0.75f, -0.25f), 1e-6f);
+    CHECK_NEAR(svm_hex_norm(0.0f, 0.0f), 0.0f, 0.0f);
+    for (int a = 0; a < 360; ++a) {
+        float theta = 2.0f * pi * a / 360.0f;
+        // The inscribed circle is inside in every direction
+        float inscribed = svm_hex_norm(sqrt3_by_2 * cosf(theta), sqrt3_by_2 * sinf(theta));
+        CHECK(inscribed <= 1.0f + 1e-6f, "theta %g norm %g", theta, inscribed);
+        // Linear in the magnitude and symmetric under 60 deg rotation
+        CHECK_NEAR(svm_hex_norm(0.3f * cosf(theta), 0.3f * sinf(theta)), 0.3f * svm_hex_norm(cosf(theta), sinf(theta)), 1e-6f);
+        CHECK_NEAR(svm_hex_norm(cosf(theta + pi / 3.0f), sinf(theta + pi / 3.0f)), svm_hex_norm(cosf(theta), sinf(theta)), 1e-5f);
+    }
+}
+
+int main() {
+    test_full_range();
+    test_sextant_boundaries();
+    test_saturation();
+    test_hex_norm();
+    return test_result("test_svm");
+}
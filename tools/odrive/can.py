@@ -0,0 +1,87 @@
+# ODrive CAN protocol over Linux SocketCAN, see MotorControl/can_protocol.h
+# Works on a real interface (can0) or a virtual one for testing without a board:
+#   sudo modprobe vcan
+#   sudo ip link add dev vcan0 type vcan
+#   sudo ip link set up vcan0
+
+import socket
+import struct
+
+CAN_NODE_ID_SHIFT = 5
+CAN_MOTOR_SHIFT   = 4
+CAN_MSG_MASK      = 0xF
+CAN_SYNC_ID       = 0x000
+
+CAN_MSG_STATUS      = 0x0
+CAN_MSG_SET_POS     = 0x1
+CAN_MSG_SET_VEL     = 0x2
+CAN_MSG_SET_CURRENT = 0x3
+CAN_MSG_POS_VEL     = 0x4
+CAN_MSG_CURRENT     = 0x5
+CAN_MSG_PDO         = 0x8
+CAN_NUM_PDOS        = 4
+
+# struct can_frame: 32 bit id, 8 bit length, 3 bytes padding, 8 bytes data
+CAN_FRAME_FORMAT = "=IB3x8s"
+CAN_FRAME_SIZE   = struct.calcsize(CAN_FRAME_FORMAT)
+
+def frame_id(node_id, motor, msg):
+  return (node_id << CAN_NODE_ID_SHIFT) | (motor << CAN_MOTOR_SHIFT) | msg
+
+def split_id(can_id):
+  return (can_id >> CAN_NODE_ID_SHIFT, (can_id >> CAN_MOTOR_SHIFT) & 1, can_id & CAN_MSG_MASK)
+
+def decode(can_id, data):
+  # Returns (node_id, motor, name, values) of a frame sent by a board
+  node_id, motor, msg = split_id(can_id)
+  if msg == CAN_MSG_STATUS:
+    error, control_mode, flags, gate_driver_fault = struct.unpack("<iBBH", data[:8])
+    return (node_id, motor, "status", {
+      "error": error,
+      "control_mode": control_mode,
+      "enable_control": bool(flags & 1),
+      "calibration_ok": bool(flags & 2),
+      "thread_ready": bool(flags & 4),
+      "gate_driver_fault": gate_driver_fault})
+  if msg == CAN_MSG_POS_VEL:
+    pos, vel = struct.unpack("<ff", data[:8])
+    return (node_id, motor, "pos_vel", {"pos": pos, "vel": vel})
+  if msg == CAN_MSG_CURRENT:
+    Iq, Ibus = struct.unpack("<ff", data[:8])
+    return (node_id, motor, "current", {"Iq": Iq, "Ibus": Ibus})
+  if CAN_MSG_PDO <= msg < CAN_MSG_PDO + CAN_NUM_PDOS:
+    # The layout depends on the mapping, see decode_pdo
+    return (node_id, motor, "pdo", {"pdo": msg - CAN_MSG_PDO, "data": data})
+  return (node_id, motor, "unknown", {"data": data})
+
+# Struct formats of the variable types, as listed by the `l` command
+PDO_TYPE_FORMATS = {"float": "f", "int": "i", "bool": "?", "uint16": "H"}
+
+def decode_pdo(data, types):
+  # Unpacks a PDO payload mapped with variables of the given types, e.g. ["float", "int"]
+  return list(struct.unpack("<" + "".join(PDO_TYPE_FORMATS[t] for t in types), data))
+
+class ODriveCan:
+  def __init__(self, interface="can0"):
+    self.sock = socket.socket(socket.PF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+    self.sock.bind((interface,))
+
+  def send(self, can_id, data):
+    self.sock.send(struct.pack(CAN_FRAME_FORMAT, can_id, len(data), data.ljust(8, b'\x00')))
+
+  def recieve(self):
+    can_id, length, data = struct.unpack(CAN_FRAME_FORMAT, self.sock.recv(CAN_FRAME_SIZE))
+    return can_id & socket.CAN_SFF_MASK, data[:length]
+
+  def set_pos(self, node_id, motor, pos, vel_feed_forward=0.0):
+    self.send(frame_id(node_id, motor, CAN_MSG_SET_POS), struct.pack("<ff", pos, vel_feed_forward))
+
+  def set_vel(self, node_id, motor, vel, current_feed_forward=0.0):
+    self.send(frame_id(node_id, motor, CAN_MSG_SET_VEL), struct.pack("<ff", vel, current_feed_forward))
+
+  def set_current(self, node_id, motor, current):
+    self.send(frame_id(node_id, motor, CAN_MSG_SET_CURRENT), struct.pack("<f", current))
+
+  def sync(self):
+    # Applies the setpoints sent since the last SYNC, on boards with can_sync set
+    self.send(CAN_SYNC_ID, b'')
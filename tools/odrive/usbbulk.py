@@ -3,6 +3,7 @@
 
 import usb.core
 import usb.util
+import errno
 import sys
 import time
 
@@ -41,6 +42,10 @@ class ODriveBulkDevice():
     # was it found?
     if self.dev is None:
       raise ODriveNotConnectedError()
+    # Received data not handed out yet. Replies and notification lines (starting
+    # with "!") share the endpoint and can arrive in the same packet.
+    self.rx = b''
+    self.notifications = []
 
   ##
   # information about the connected device
@@ -108,14 +113,58 @@ class ODriveBulkDevice():
       #return -1
       raise
 
-  def recieve(self, bufferLen):
+  def recieve(self, bufferLen, timeout=0):
     try:
-      ret = self.epr.read(bufferLen, 0)
+      ret = self.epr.read(bufferLen, timeout)
       return ret
     except usb.core.USBError:
       #return -1
       raise
 
+  def take_notifications(self):
+    # Moves the complete notification lines at the start of the received data to self.notifications
+    while self.rx.startswith(b'!') and b'\n' in self.rx:
+      line, self.rx = self.rx.split(b'\n', 1)
+      self.notifications.append(line.decode('ascii'))
+
+  def command(self, command):
+    # Sends a command and returns its reply line, without the newline
+    self.send(command)
+    while True:
+      self.take_notifications()
+      if not self.rx.startswith(b'!') and b'\n' in self.rx:
+        line, self.rx = self.rx.split(b'\n', 1)
+        return line.decode('ascii')
+      self.rx += bytes(self.recieve(self.recieve_max()))
+
+  def transfer(self, request, length):
+    # Sends a binary G request and returns the length bytes of the reply after the G
+    self.send(request)
+    while True:
+      self.take_notifications()
+      if self.rx and not self.rx.startswith(b'!') and not self.rx.startswith(b'G'):
+        if b'\n' not in self.rx:
+          self.rx += bytes(self.recieve(self.recieve_max()))
+          continue
+        # The board replies 0 to a request with an unknown ID
+        line, self.rx = self.rx.split(b'\n', 1)
+        raise ValueError("the board refused the request: " + line.decode('ascii', 'replace'))
+      if len(self.rx) > length:
+        reply, self.rx = self.rx[1:length + 1], self.rx[length + 1:]
+        return reply
+      self.rx += bytes(self.recieve(self.recieve_max()))
+
+  def poll_notifications(self, timeout=100):
+    # Returns the notification lines received so far, waiting up to timeout ms for new ones
+    try:
+      self.rx += bytes(self.recieve(self.recieve_max(), timeout))
+    except usb.core.USBError as e:
+      if e.errno != errno.ETIMEDOUT:
+        raise
+    self.take_notifications()
+    notifications, self.notifications = self.notifications, []
+    return notifications
+
   def send_max(self):
     return 64
 
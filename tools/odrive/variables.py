@@ -0,0 +1,112 @@
+# Variable registry of the firmware, see MotorControl/commands.h.
+# The IDs change between firmware versions, so read the list when connecting
+# and address the variables by name:
+#   dev = usbbulk.poll_odrive_bulk_device()
+#   dev.init()
+#   odrive = Variables(dev)
+#   odrive.set("motors[0].vel_limit", 10000)
+
+import struct
+
+# Struct formats of the types in the binary G and S commands
+TYPE_FORMATS = {"float": "f", "int": "i", "bool": "?", "uint16": "H"}
+# Both requests have to fit into one USB packet, see motor_parse_cmd
+MAX_REQUEST = 63
+
+class Variable:
+  def __init__(self, id, line):
+    # line as printed by `l <id>`: name type access unit min max
+    name, type, access, unit, min, max = line.split()
+    self.id = id
+    self.name = name
+    self.type = type
+    self.writable = access == "rw"
+    self.unit = "" if unit == "-" else unit
+    self.min = float(min)
+    self.max = float(max)
+
+  def parse(self, reply):
+    return float(reply) if self.type == "float" else int(reply)
+
+  def format(self):
+    return TYPE_FORMATS[self.type]
+
+  def check(self, value):
+    if not self.writable:
+      raise ValueError(self.name + " is read only")
+    if self.type != "bool" and not self.min <= value <= self.max:
+      raise ValueError("%s must be between %g and %g" % (self.name, self.min, self.max))
+
+class Variables:
+  def __init__(self, dev):
+    # dev sends commands with send(), and command() also returns the reply line
+    self.dev = dev
+    count = int(dev.command("l"))
+    self.by_name = {}
+    self.by_id = []
+    for id in range(count):
+      var = Variable(id, dev.command("l %d" % id))
+      self.by_name[var.name] = var
+      self.by_id.append(var)
+
+  def __getitem__(self, name):
+    return self.by_name[name]
+
+  def names(self):
+    return list(self.by_name)
+
+  def get(self, name):
+    var = self.by_name[name]
+    return var.parse(self.dev.command("g %d" % var.id))
+
+  def set(self, name, value):
+    var = self.by_name[name]
+    var.check(value)
+    if self.dev.command("s %d %s" % (var.id, int(value) if var.type != "float" else value)) != "1":
+      raise ValueError("the board refused the value")
+
+  def get_many(self, names):
+    # Reads the variables in one request, the values are from the same control cycle
+    vars = [self.by_name[name] for name in names]
+    request = struct.pack("<cB%dH" % len(vars), b"G", len(vars), *[var.id for var in vars])
+    if len(request) > MAX_REQUEST:
+      raise ValueError("too many variables for one request")
+    reply_format = "<" + "".join(var.format() for var in vars)
+    values = struct.unpack(reply_format, self.dev.transfer(request, struct.calcsize(reply_format)))
+    return dict(zip(names, values))
+
+  def set_many(self, values):
+    # Writes a dict of name: value in one request. The control loop sees either
+    # all of them or, if the board refuses any, none.
+    request = struct.pack("<cB", b"S", len(values))
+    for name, value in values.items():
+      var = self.by_name[name]
+      var.check(value)
+      if var.type != "float":
+        value = int(value)
+      request += struct.pack("<H" + var.format(), var.id, value)
+    if len(request) > MAX_REQUEST:
+      raise ValueError("too many variables for one request")
+    if self.dev.command(request) != "1":
+      raise ValueError("the board refused the values")
+
+  def subscribe(self, name, deadband=0):
+    # The board pushes the value whenever it changes by more than deadband,
+    # on any change with deadband 0. The current value is pushed right away.
+    if self.dev.command("n %d %g" % (self.by_name[name].id, deadband)) != "1":
+      raise ValueError("the board refused the subscription")
+
+  def unsubscribe(self, name=None):
+    # Of all variables if name is None. u has no reply
+    self.dev.send("u %d" % self.by_name[name].id if name is not None else "u")
+
+  def notifications(self, timeout=100):
+    # Returns the changes pushed since the last call as (seq, time_ms, name, value),
+    # waiting up to timeout ms for new ones
+    changes = []
+    for line in self.dev.poll_notifications(timeout):
+      _, seq, time_ms, id, value = line.split()
+      var = self.by_id[int(id)]
+      value, = struct.unpack("<" + var.format(), bytes.fromhex(value))
+      changes.append((int(seq), int(time_ms), var.name, value))
+    return changes
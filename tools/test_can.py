@@ -0,0 +1,59 @@
+#! /usr/bin/env python3
+
+import argparse
+
+def parse_args():
+  parser = argparse.ArgumentParser(description='Talk to ODrive boards over SocketCAN.')
+  parser.add_argument('--interface', default='can0', help='SocketCAN interface, e.g. can0 or vcan0')
+  return parser.parse_args()
+
+if __name__ == '__main__':
+  # parse args before other imports
+  args = parse_args()
+
+import threading
+from odrive import can
+
+running = True
+
+def main(args):
+  global running
+  print("ODrive CAN Communications")
+  print("---------------------------------------------------------------------")
+  print("USAGE:")
+  print("\tPOSITION_CONTROL:\n\t\tp NODE_ID MOTOR_NUMBER POSITION VELOCITY")
+  print("\tVELOCITY_CONTROL:\n\t\tv NODE_ID MOTOR_NUMBER VELOCITY CURRENT")
+  print("\tCURRENT_CONTROL:\n\t\tc NODE_ID MOTOR_NUMBER CURRENT")
+  print("\tSYNC:\n\t\ts")
+  print("---------------------------------------------------------------------")
+  bus = can.ODriveCan(args.interface)
+  thread = threading.Thread(target=recieve_thread, args=[bus], daemon=True)
+  thread.start()
+  while running:
+    try:
+      command = input("Enter ODrive command:\n").split()
+      if not command:
+        continue
+      if command[0] == 's':
+        bus.sync()
+        continue
+      node_id, motor = int(command[1]), int(command[2])
+      values = [float(x) for x in command[3:]]
+      if command[0] == 'p':
+        bus.set_pos(node_id, motor, *values)
+      elif command[0] == 'v':
+        bus.set_vel(node_id, motor, *values)
+      elif command[0] == 'c':
+        bus.set_current(node_id, motor, *values)
+    except (EOFError, KeyboardInterrupt):
+      running = False
+    except (IndexError, ValueError, TypeError):
+      print("invalid command")
+
+def recieve_thread(bus):
+  while running:
+    can_id, data = bus.recieve()
+    print(can.decode(can_id, data))
+
+if __name__ == "__main__":
+   main(args)